@@ -0,0 +1,128 @@
+/*
+* benchjpeg.cpp
+* JPEG decode speed and accuracy for each codec_params::profile
+*
+* Usage: benchjpeg [-n repeats] [-s size] [-q quality]
+* Encodes a synthetic RGB image with noise, 8 and 12 bit, with each profile, then decodes it
+* Reports the best decode time in megapixels per second and the PSNR against the input
+*/
+
+#include "icd_codecs.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+using namespace ICD;
+using namespace std;
+
+// Smooth color with noise, values up to maxval
+template<typename T> static vector<T> synthetic(size_t sz, int maxval) {
+    uint32_t seed = 1;
+    auto rnd = [&]() {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) & 0xff;
+    };
+    vector<T> pixels(sz * sz * 3);
+    T* p = pixels.data();
+    double scale = maxval / 255.0;
+    for (size_t y = 0; y < sz; y++) {
+        for (size_t x = 0; x < sz; x++) {
+            *p++ = static_cast<T>(scale * ((x * 192 / sz) + rnd() % 32));
+            *p++ = static_cast<T>(scale * ((y * 192 / sz) + rnd() % 32));
+            *p++ = static_cast<T>(scale * (((x + y) * 96 / sz) + rnd() % 32));
+        }
+    }
+    return pixels;
+}
+
+template<typename T> static double psnr(const vector<T>& a, const vector<T>& b, int maxval) {
+    double sum = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        double d = static_cast<double>(a[i]) - b[i];
+        sum += d * d;
+    }
+    if (sum == 0)
+        return 99;
+    return 10 * log10(static_cast<double>(maxval) * maxval * a.size() / sum);
+}
+
+// Best time of n runs, in seconds
+template<typename F> static double best_of(int n, F fn) {
+    double best = 1e30;
+    for (int i = 0; i < n; i++) {
+        auto start = chrono::steady_clock::now();
+        fn();
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+// Decode speed and PSNR of one profile, false on error
+template<typename T> static bool measure(const vector<T>& pixels, size_t sz, ICDDataType dt,
+    int maxval, SPEED_T profile, int quality, int repeats, double& mps, double& db)
+{
+    Raster r = {};
+    r.size = { sz, sz, 0, 3, 0 };
+    r.dt = dt;
+    r.format = IMG_JPEG;
+    jpeg_params params(r);
+    params.quality = quality;
+    params.profile = profile;
+    storage_manager src(const_cast<T*>(pixels.data()), pixels.size() * sizeof(T));
+    vector<uint8_t> jpg(src.size + 16384);
+    storage_manager dst(jpg.data(), jpg.size());
+    const char* message = jpeg_encode(params, src, dst);
+    if (message) {
+        cerr << "Encode: " << message << endl;
+        return false;
+    }
+
+    vector<T> out(pixels.size());
+    double dec = best_of(repeats, [&]() {
+        codec_params dparams(r);
+        dparams.profile = profile;
+        storage_manager in(jpg.data(), dst.size);
+        message = stride_decode(dparams, in, out.data());
+    });
+    if (message) {
+        cerr << "Decode: " << message << endl;
+        return false;
+    }
+    mps = static_cast<double>(sz * sz) / dec / 1e6;
+    db = psnr(pixels, out, maxval);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    int repeats = 5, quality = 75;
+    size_t sz = 2048;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "-n"))
+            repeats = max(1, atoi(argv[i + 1]));
+        else if (!strcmp(argv[i], "-s"))
+            sz = max(16, atoi(argv[i + 1]));
+        else if (!strcmp(argv[i], "-q"))
+            quality = atoi(argv[i + 1]);
+    }
+
+    auto pixels8 = synthetic<uint8_t>(sz, 255);
+    auto pixels12 = synthetic<uint16_t>(sz, 4095);
+    static const SPEED_T profiles[] = { SPEED_EXACT, SPEED_BALANCED, SPEED_FAST };
+    static const char* names[] = { "EXACT", "BALANCED", "FAST" };
+    cout << sz << "x" << sz << " RGB, quality " << quality << endl;
+    cout << left << setw(10) << "Profile" << right << setw(14) << "8 bit MP/s" << setw(12)
+        << "8 bit dB" << setw(14) << "12 bit MP/s" << setw(12) << "12 bit dB" << endl;
+    for (int i = 0; i < 3; i++) {
+        double mps8, db8, mps12, db12;
+        if (!measure(pixels8, sz, ICDT_Byte, 255, profiles[i], quality, repeats, mps8, db8)
+            || !measure(pixels12, sz, ICDT_UInt16, 4095, profiles[i], quality, repeats, mps12, db12))
+            return 1;
+        cout << left << setw(10) << names[i] << right << fixed << setprecision(2)
+            << setw(14) << mps8 << setw(12) << db8 << setw(14) << mps12 << setw(12) << db12 << endl;
+    }
+    return 0;
+}
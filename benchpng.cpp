@@ -0,0 +1,181 @@
+/*
+* benchpng.cpp
+* PNG encode and decode speed, with the deflate backend libicd was built with
+*
+* Usage: benchpng [-n repeats] [tile.png ...]
+* Each tile is decoded, then encoded and decoded again with libicd, the best time is reported
+* Without input files, it uses synthetic 512x512 tiles
+* To compare backends, run it from builds with and without -DUSE_LIBDEFLATE=ON
+*/
+
+#include "icd_codecs.h"
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+using namespace ICD;
+using namespace std;
+
+struct Tile {
+    string name;
+    Raster raster;
+    vector<uint8_t> pixels;
+};
+
+// Synthetic tiles, from easy to hard to compress
+static vector<Tile> synthetic() {
+    const size_t sz = 512;
+    uint32_t seed = 1;
+    auto rnd = [&]() {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 16) & 0xff;
+    };
+    static const char* names[] = { "gradient", "imagery", "overlay", "elevation" };
+    vector<Tile> tiles(4);
+    for (int kind = 0; kind < 4; kind++) {
+        Tile& t = tiles[kind];
+        t.name = names[kind];
+        t.raster = {};
+        t.raster.size = { sz, sz, 0, static_cast<size_t>((kind == 3) ? 1 : (kind == 2) ? 4 : 3), 0 };
+        t.raster.dt = (kind == 3) ? ICDT_UInt16 : ICDT_Byte;
+        t.raster.format = IMG_PNG;
+        t.pixels.resize(getTypeSize(t.raster.dt, sz * sz * t.raster.size.c));
+        uint8_t* p = t.pixels.data();
+        uint16_t* p16 = reinterpret_cast<uint16_t*>(p);
+        for (size_t y = 0; y < sz; y++) {
+            for (size_t x = 0; x < sz; x++) {
+                switch (kind) {
+                case 0: // Smooth color
+                    *p++ = static_cast<uint8_t>(x / 2);
+                    *p++ = static_cast<uint8_t>(y / 2);
+                    *p++ = static_cast<uint8_t>((x + y) / 4);
+                    break;
+                case 1: // Smooth color with noise
+                    *p++ = static_cast<uint8_t>(x / 4 + rnd() % 32);
+                    *p++ = static_cast<uint8_t>(y / 4 + rnd() % 32);
+                    *p++ = static_cast<uint8_t>((x + y) / 8 + rnd() % 32);
+                    break;
+                case 2: { // Mostly transparent, with a grid of colored lines
+                    bool on = (x % 64 < 3) || (y % 48 < 2);
+                    *p++ = on ? 200 : 0;
+                    *p++ = on ? static_cast<uint8_t>(x) : 0;
+                    *p++ = on ? static_cast<uint8_t>(y) : 0;
+                    *p++ = on ? 255 : 0;
+                    break;
+                }
+                case 3: // Terrain like surface
+                    *p16++ = static_cast<uint16_t>(1000 + 300 * sin(x / 40.0) * cos(y / 55.0)
+                        + rnd() % 4);
+                    break;
+                }
+            }
+        }
+    }
+    return tiles;
+}
+
+static bool load(const char* fname, Tile& t) {
+    ifstream f(fname, ios::binary);
+    vector<uint8_t> png((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
+    storage_manager src(png.data(), png.size());
+    t.name = fname;
+    t.raster = {};
+    const char* message = png_peek(src, t.raster);
+    if (message) {
+        cerr << fname << ": " << message << endl;
+        return false;
+    }
+    codec_params params(t.raster);
+    t.pixels.resize(params.get_buffer_size());
+    message = stride_decode(params, src, t.pixels.data());
+    if (message) {
+        cerr << fname << ": " << message << endl;
+        return false;
+    }
+    return true;
+}
+
+// Best time of n runs, in seconds
+template<typename F> static double best_of(int n, F fn) {
+    double best = 1e30;
+    for (int i = 0; i < n; i++) {
+        auto start = chrono::steady_clock::now();
+        fn();
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    int repeats = 10;
+    vector<Tile> tiles;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            repeats = max(1, atoi(argv[++i]));
+            continue;
+        }
+        Tile t;
+        if (!load(argv[i], t))
+            return 1;
+        tiles.push_back(t);
+    }
+    if (tiles.empty())
+        tiles = synthetic();
+
+    cout << "Deflate backend: " << png_backend() << endl;
+    cout << left << setw(24) << "Tile" << right << setw(10) << "Raw KB" << setw(10) << "PNG KB"
+        << setw(14) << "Encode MB/s" << setw(14) << "Decode MB/s" << endl;
+    double total_raw = 0, total_png = 0, total_enc = 0, total_dec = 0;
+    int errors = 0;
+    for (auto& t : tiles) {
+        png_params params(t.raster);
+        storage_manager src(t.pixels.data(), t.pixels.size());
+        vector<uint8_t> png(t.pixels.size() * 2 + 1024);
+        size_t size = 0;
+        const char* message = nullptr;
+        double enc = best_of(repeats, [&]() {
+            storage_manager dst(png.data(), png.size());
+            message = png_encode(params, src, dst);
+            size = dst.size;
+        });
+        if (message) {
+            cerr << t.name << ": " << message << endl;
+            errors++;
+            continue;
+        }
+
+        vector<uint8_t> pixels(t.pixels.size());
+        double dec = best_of(repeats, [&]() {
+            codec_params dparams(t.raster);
+            storage_manager in(png.data(), size);
+            message = stride_decode(dparams, in, pixels.data());
+        });
+        if (message || pixels != t.pixels) {
+            cerr << t.name << ": " << (message ? message : "Decoded tile is different") << endl;
+            errors++;
+            continue;
+        }
+
+        double raw = static_cast<double>(t.pixels.size());
+        cout << left << setw(24) << t.name << right << fixed << setprecision(1)
+            << setw(10) << raw / 1024 << setw(10) << size / 1024.0
+            << setw(14) << raw / enc / 1e6 << setw(14) << raw / dec / 1e6 << endl;
+        total_raw += raw;
+        total_png += static_cast<double>(size);
+        total_enc += enc;
+        total_dec += dec;
+    }
+    if (total_raw > 0)
+        cout << left << setw(24) << "Total" << right << fixed << setprecision(1)
+            << setw(10) << total_raw / 1024 << setw(10) << total_png / 1024
+            << setw(14) << total_raw / total_enc / 1e6 << setw(14) << total_raw / total_dec / 1e6
+            << endl;
+    return errors ? 1 : 0;
+}
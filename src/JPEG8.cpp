@@ -7,6 +7,7 @@
 */
 
 #include "JPEG_codec.h"
+#include <algorithm>
 
 extern "C" {
 #include <jpeglib.h>
@@ -127,6 +128,15 @@ static boolean zenChunkHandler(j_decompress_ptr cinfo) {
     return true;
 }
 
+// DCT method matching the speed profile
+static J_DCT_METHOD dct_method(SPEED_T profile) {
+    switch (profile) {
+    case SPEED_BALANCED: return JDCT_ISLOW;
+    case SPEED_FAST: return JDCT_IFAST;
+    default: return JDCT_FLOAT;
+    }
+}
+
 //
 // IMPROVE: could reuse the cinfo, to save some memory allocation
 // IMPROVE: Use a jpeg memory manager to link JPEG memory into apache's pool mechanism
@@ -179,7 +189,17 @@ const char *jpeg8_stride_decode(codec_params &params, storage_manager &src, void
     // Set the zen chunk reader before reading the header
     jpeg_set_marker_processor(&cinfo, JPEG_APP0 + 3, zenChunkHandler);
     jpeg_read_header(&cinfo, TRUE);
-    cinfo.dct_method = JDCT_FLOAT;
+    cinfo.dct_method = dct_method(params.profile);
+    if (SPEED_FAST == params.profile) {
+        // Allows merged upsampling for subsampled color
+        cinfo.do_fancy_upsampling = FALSE;
+        cinfo.do_block_smoothing = FALSE;
+    }
+    // Reduced size decode, 1/8 is a DC only IDCT
+    if (params.reduction < 0 || params.reduction > 3)
+        sprintf(params.error_message, "Unsupported JPEG reduction");
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = 1u << (params.reduction & 3);
 
     auto const& rsize = params.raster.size;
     if (!(rsize.c == 1 || rsize.c == 3))
@@ -197,14 +217,14 @@ const char *jpeg8_stride_decode(codec_params &params, storage_manager &src, void
     // In bytes
     auto line_stride = params.line_stride;
     if (0 == line_stride)
-        line_stride = rsize.c * rsize.x;
+        line_stride = rsize.c * params.reduced(rsize.x);
 
     // Only if the error message hasn't been set already
     if (params.error_message[0] == 0) {
         // Force output to desired number of channels
         cinfo.out_color_space = (rsize.c == 3) ? JCS_RGB : JCS_GRAYSCALE;
         jpeg_start_decompress(&cinfo);
-        while (cinfo.output_scanline < cinfo.image_height) {
+        while (cinfo.output_scanline < cinfo.output_height) {
             JSAMPLE* rp[2]; // Two lines at a time
             // Do the math in bytes, because line_stride is in bytes
             rp[0] = (JSAMPROW)((char *)buffer + line_stride * cinfo.output_scanline);
@@ -238,6 +258,18 @@ const char *jpeg8_stride_decode(codec_params &params, storage_manager &src, void
             }
         }
 
+        if (params.reduction) {
+            BitMask rbm(
+                static_cast<unsigned int>(params.reduced(rsize.x)),
+                static_cast<unsigned int>(params.reduced(rsize.y)));
+            reduce_mask(bm, rbm, params.reduction);
+            params.modified = apply_mask(&rbm,
+                reinterpret_cast<JSAMPROW>(buffer),
+                static_cast<int>(rsize.c),
+                static_cast<int>(line_stride));
+            return nullptr;
+        }
+
         params.modified = apply_mask(&bm,
             reinterpret_cast<JSAMPROW>(buffer),
             static_cast<int>(rsize.c),
@@ -352,7 +384,7 @@ const char *jpeg8_encode(jpeg_params &params, storage_manager &src, storage_mana
     jpeg_set_defaults(&cinfo);
 
     jpeg_set_quality(&cinfo, params.quality, TRUE);
-    cinfo.dct_method = JDCT_FLOAT;
+    cinfo.dct_method = dct_method(params.profile);
     linesize = static_cast<size_t>(cinfo.image_width) * cinfo.num_components;
 
     jpeg_start_compress(&cinfo, TRUE);
@@ -375,4 +407,279 @@ const char *jpeg8_encode(jpeg_params &params, storage_manager &src, storage_mana
         params.error_message : nullptr;
 }
 
+//
+// Rescale the quantized DCT coefficients from the source tables to the destination ones
+// The destination tables are never finer than the source ones, that would only make the
+// output larger without improving it
+//
+static void requantize_coefficients(j_decompress_ptr srcinfo, j_compress_ptr cinfo,
+    jvirt_barray_ptr *coef_arrays)
+{
+    for (int ci = 0; ci < cinfo->num_components; ci++) {
+        const JQUANT_TBL *sqt = srcinfo->comp_info[ci].quant_table;
+        JQUANT_TBL *dqt = cinfo->quant_tbl_ptrs[cinfo->comp_info[ci].quant_tbl_no];
+        if (nullptr == sqt || nullptr == dqt)
+            ERREXIT1(cinfo, JERR_NO_QUANT_TABLE, cinfo->comp_info[ci].quant_tbl_no);
+        for (int k = 0; k < DCTSIZE2; k++)
+            dqt->quantval[k] = std::max(dqt->quantval[k], sqt->quantval[k]);
+    }
+
+    for (int ci = 0; ci < cinfo->num_components; ci++) {
+        // Block counts are only set in the source at this point
+        jpeg_component_info *comp = &srcinfo->comp_info[ci];
+        const UINT16 *sq = comp->quant_table->quantval;
+        const UINT16 *dq = cinfo->quant_tbl_ptrs[cinfo->comp_info[ci].quant_tbl_no]->quantval;
+        if (0 == memcmp(sq, dq, DCTSIZE2 * sizeof(UINT16)))
+            continue; // Same table, nothing to do
+
+        for (JDIMENSION by = 0; by < comp->height_in_blocks; by++) {
+            JBLOCKARRAY rows = (*srcinfo->mem->access_virt_barray)
+                (reinterpret_cast<j_common_ptr>(srcinfo), coef_arrays[ci], by, 1, TRUE);
+            JBLOCKROW blocks = rows[0];
+            for (JDIMENSION bx = 0; bx < comp->width_in_blocks; bx++) {
+                JCOEF *coef = blocks[bx];
+                for (int k = 0; k < DCTSIZE2; k++) {
+                    // Round to nearest, symmetric around zero
+                    long v = static_cast<long>(coef[k]) * sq[k];
+                    long half = dq[k] / 2;
+                    coef[k] = static_cast<JCOEF>((v < 0) ?
+                        -((half - v) / dq[k]) : (v + half) / dq[k]);
+                }
+            }
+        }
+    }
+}
+
+//
+// Re-compress a JPEG at params.quality, working on the DCT coefficients
+// Skips the IDCT, FDCT and color conversion, the Zen chunk is copied as is
+//
+const char *jpeg8_requantize(jpeg_params &params, storage_manager &src, storage_manager &dst)
+{
+    struct jpeg_decompress_struct srcinfo;
+    struct jpeg_compress_struct cinfo;
+    jpeg_error_mgr err;
+    JPGHandle jh;
+    jpeg_destination_mgr mgr;
+    memset(&jh, 0, sizeof(jh));
+    memset(&srcinfo, 0, sizeof(srcinfo));
+    memset(&cinfo, 0, sizeof(cinfo));
+
+    struct jpeg_source_mgr s = { (JOCTET *)src.buffer, static_cast<size_t>(src.size) };
+    s.term_source = s.init_source = stub_source_dec;
+    s.skip_input_data = skip_input_data_dec;
+    s.fill_input_buffer = fill_input_buffer_dec;
+    s.resync_to_restart = jpeg_resync_to_restart;
+
+    mgr.next_output_byte = (JOCTET *)dst.buffer;
+    mgr.free_in_buffer = dst.size;
+    mgr.init_destination = init_or_terminate_destination;
+    mgr.empty_output_buffer = empty_output_buffer;
+    mgr.term_destination = init_or_terminate_destination;
+
+    memset(&err, 0, sizeof(err));
+    srcinfo.err = cinfo.err = jpeg_std_error(&err);
+    err.error_exit = errorExit;
+    err.emit_message = emitMessage;
+    jh.message = params.error_message;
+    srcinfo.client_data = cinfo.client_data = &jh;
+    params.error_message[0] = 0; // Clear error messages
+
+    if (setjmp(jh.setjmpBuffer)) {
+        jpeg_destroy_compress(&cinfo);
+        jpeg_destroy_decompress(&srcinfo);
+        return params.error_message;
+    }
+
+    jpeg_create_decompress(&srcinfo);
+    jpeg_create_compress(&cinfo);
+    srcinfo.src = &s;
+    jpeg_set_marker_processor(&srcinfo, JPEG_APP0 + 3, zenChunkHandler);
+    jpeg_read_header(&srcinfo, TRUE);
+    if (srcinfo.data_precision != 8)
+        ERREXIT1(&srcinfo, JERR_BAD_PRECISION, srcinfo.data_precision);
+
+    jvirt_barray_ptr *coef_arrays = jpeg_read_coefficients(&srcinfo);
+    jpeg_copy_critical_parameters(&srcinfo, &cinfo);
+    cinfo.dest = &mgr;
+    jpeg_set_quality(&cinfo, params.quality, TRUE);
+    // Huffman tables have to be rebuilt anyhow, might as well be optimal
+    cinfo.optimize_coding = TRUE;
+    requantize_coefficients(&srcinfo, &cinfo, coef_arrays);
+
+    jpeg_write_coefficients(&cinfo, coef_arrays);
+    // The handler points past the signature, which is still in the source buffer
+    if (nullptr != jh.zenChunk.buffer)
+        jpeg_write_marker(&cinfo, JPEG_APP0 + 3,
+            reinterpret_cast<JOCTET *>(jh.zenChunk.buffer) - CHUNK_NAME_SIZE,
+            static_cast<unsigned int>(jh.zenChunk.size + CHUNK_NAME_SIZE));
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_finish_decompress(&srcinfo);
+    jpeg_destroy_compress(&cinfo);
+    jpeg_destroy_decompress(&srcinfo);
+    dst.size -= mgr.free_in_buffer;
+
+    return params.error_message[0] != 0 ?
+        params.error_message : nullptr;
+}
+
+// Copy the coefficients of all components between the virtual arrays and a flat buffer
+static void copy_coefficients(j_decompress_ptr srcinfo, jvirt_barray_ptr *coef_arrays,
+    std::vector<JCOEF> &saved, bool restore)
+{
+    size_t sz = 0;
+    for (int ci = 0; ci < srcinfo->num_components; ci++) {
+        const jpeg_component_info *comp = &srcinfo->comp_info[ci];
+        sz += static_cast<size_t>(comp->width_in_blocks) * comp->height_in_blocks * DCTSIZE2;
+    }
+    if (!restore)
+        saved.resize(sz);
+
+    JCOEF *p = saved.data();
+    for (int ci = 0; ci < srcinfo->num_components; ci++) {
+        const jpeg_component_info *comp = &srcinfo->comp_info[ci];
+        size_t rowsz = sizeof(JBLOCK) * comp->width_in_blocks;
+        for (JDIMENSION by = 0; by < comp->height_in_blocks; by++) {
+            JBLOCKARRAY rows = (*srcinfo->mem->access_virt_barray)
+                (reinterpret_cast<j_common_ptr>(srcinfo), coef_arrays[ci], by, 1, restore);
+            if (restore)
+                memcpy(rows[0], p, rowsz);
+            else
+                memcpy(p, rows[0], rowsz);
+            p += comp->width_in_blocks * DCTSIZE2;
+        }
+    }
+}
+
+// One step of the budget quality search, writes the saved coefficients at quality q
+// It has its own setjmp, so the search state is never live across a longjmp
+// Returns 0 on success, 1 if the output doesn't fit in budget bytes, -1 on other errors
+static int budget_trial(j_decompress_ptr srcinfo, jvirt_barray_ptr *coef_arrays,
+    std::vector<JCOEF> &saved, JPGHandle &jh, jpeg_destination_mgr &mgr, void *buffer,
+    size_t budget, int q)
+{
+    struct jpeg_compress_struct cinfo;
+    memset(&cinfo, 0, sizeof(cinfo));
+    cinfo.err = srcinfo->err;
+    cinfo.client_data = &jh;
+
+    if (setjmp(jh.setjmpBuffer)) {
+        jpeg_destroy_compress(&cinfo);
+        return (srcinfo->err->msg_code == JERR_EMS_WRITE) ? 1 : -1;
+    }
+
+    copy_coefficients(srcinfo, coef_arrays, saved, true);
+    mgr.next_output_byte = (JOCTET *)buffer;
+    mgr.free_in_buffer = budget;
+    jpeg_create_compress(&cinfo);
+    jpeg_copy_critical_parameters(srcinfo, &cinfo);
+    cinfo.dest = &mgr;
+    jpeg_set_quality(&cinfo, q, TRUE);
+    cinfo.optimize_coding = TRUE;
+    requantize_coefficients(srcinfo, &cinfo, coef_arrays);
+    jpeg_write_coefficients(&cinfo, coef_arrays);
+    if (nullptr != jh.zenChunk.buffer)
+        jpeg_write_marker(&cinfo, JPEG_APP0 + 3,
+            reinterpret_cast<JOCTET *>(jh.zenChunk.buffer) - CHUNK_NAME_SIZE,
+            static_cast<unsigned int>(jh.zenChunk.size + CHUNK_NAME_SIZE));
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return 0;
+}
+
+//
+// Encode at the highest quality, up to params.quality, that fits in params.budget bytes
+// The DCT is done only once, by encoding at quality 100, where all the quantizers are 1
+// Each step of the quality search only requantizes and entropy codes the coefficients
+// On success, params.quality is set to the quality used
+//
+const char *jpeg8_encode_budget(jpeg_params &params, storage_manager &src, storage_manager &dst)
+{
+    // Near lossless, it can be larger than the input
+    jpeg_params p100(params);
+    p100.quality = 100;
+    p100.budget = 0;
+    std::vector<unsigned char> cbuffer(4 * params.get_buffer_size() + 16384);
+    storage_manager coefs(cbuffer.data(), cbuffer.size());
+    if (jpeg8_encode(p100, src, coefs)) {
+        strcpy(params.error_message, p100.error_message);
+        return params.error_message;
+    }
+
+    size_t budget = std::min(params.budget, dst.size);
+    struct jpeg_decompress_struct srcinfo;
+    jpeg_error_mgr err;
+    JPGHandle jh;
+    jpeg_destination_mgr mgr;
+    memset(&jh, 0, sizeof(jh));
+    memset(&srcinfo, 0, sizeof(srcinfo));
+
+    struct jpeg_source_mgr s = { (JOCTET *)coefs.buffer, static_cast<size_t>(coefs.size) };
+    s.term_source = s.init_source = stub_source_dec;
+    s.skip_input_data = skip_input_data_dec;
+    s.fill_input_buffer = fill_input_buffer_dec;
+    s.resync_to_restart = jpeg_resync_to_restart;
+
+    mgr.init_destination = init_or_terminate_destination;
+    mgr.empty_output_buffer = empty_output_buffer;
+    mgr.term_destination = init_or_terminate_destination;
+
+    memset(&err, 0, sizeof(err));
+    srcinfo.err = jpeg_std_error(&err);
+    err.error_exit = errorExit;
+    err.emit_message = emitMessage;
+    jh.message = params.error_message;
+    srcinfo.client_data = &jh;
+    params.error_message[0] = 0; // Clear error messages
+
+    if (setjmp(jh.setjmpBuffer)) {
+        jpeg_destroy_decompress(&srcinfo);
+        return params.error_message;
+    }
+
+    jpeg_create_decompress(&srcinfo);
+    srcinfo.src = &s;
+    jpeg_set_marker_processor(&srcinfo, JPEG_APP0 + 3, zenChunkHandler);
+    jpeg_read_header(&srcinfo, TRUE);
+    jvirt_barray_ptr *coef_arrays = jpeg_read_coefficients(&srcinfo);
+    std::vector<JCOEF> saved;
+    copy_coefficients(&srcinfo, coef_arrays, saved, false);
+
+    // Bisection over quality, the last pass rewrites the best one if needed
+    int best = 0, q = 0;
+    for (int lo = 1, hi = std::min(params.quality, 100); ; ) {
+        bool last = lo > hi;
+        if (last && (0 == best || best == q))
+            break;
+        q = last ? best : (lo + hi) / 2;
+
+        int status = budget_trial(&srcinfo, coef_arrays, saved, jh, mgr, dst.buffer, budget, q);
+        if (status < 0) {
+            jpeg_destroy_decompress(&srcinfo);
+            return params.error_message;
+        }
+        if (status > 0) { // Doesn't fit, try lower
+            params.error_message[0] = 0;
+            hi = q - 1;
+            continue;
+        }
+
+        best = q;
+        lo = q + 1;
+        if (last)
+            break;
+    }
+
+    jpeg_destroy_decompress(&srcinfo);
+    if (0 == best) {
+        strcpy(params.error_message, "Write buffer too small");
+        return params.error_message;
+    }
+
+    params.quality = best;
+    dst.size = budget - mgr.free_in_buffer;
+    return nullptr;
+}
+
 NS_END // ICD
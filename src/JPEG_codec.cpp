@@ -116,25 +116,16 @@ const char* jpeg_stride_decode(codec_params& params, storage_manager& src, void*
         : jpeg12_stride_decode(params, src, buffer);
 }
 
-const char *jpeg_encode(jpeg_params &params, storage_manager &src, storage_manager &dst)
+// Maps the odd libjpeg messages to the actual reason
+static const char* jpeg_report(jpeg_params& params, const char* message)
 {
     constexpr size_t MSGSZ = sizeof(params.error_message) - 1;
-    const char* message = nullptr;
-    switch (getTypeSize(params.raster.dt)) {
-    case 1:
-        message = jpeg8_encode(params, src, dst);
-        break;
-    case 2:
-        message = jpeg12_encode(params, src, dst);
-        break;
-    default:
-        message = "Usage error, only 8 and 12 bit input can be encoded as JPEG";
-    }
     if (!message)
         return nullptr;
 
     // Had an error reported
-    strncpy(params.error_message, message, MSGSZ);
+    if (message != params.error_message)
+        strncpy(params.error_message, message, MSGSZ);
     if (std::string::npos != std::string(message).find("Write to EMS")) {
         // Convert weird message to the actual reason
         strncpy(params.error_message, "Write buffer too small", MSGSZ);
@@ -143,4 +134,33 @@ const char *jpeg_encode(jpeg_params &params, storage_manager &src, storage_manag
     return message;
 }
 
+const char *jpeg_encode(jpeg_params &params, storage_manager &src, storage_manager &dst)
+{
+    const char* message = nullptr;
+    switch (getTypeSize(params.raster.dt)) {
+    case 1:
+        message = params.budget ? jpeg8_encode_budget(params, src, dst)
+            : jpeg8_encode(params, src, dst);
+        break;
+    case 2:
+        message = params.budget ? jpeg12_encode_budget(params, src, dst)
+            : jpeg12_encode(params, src, dst);
+        break;
+    default:
+        message = "Usage error, only 8 and 12 bit input can be encoded as JPEG";
+    }
+    return jpeg_report(params, message);
+}
+
+const char* jpeg_requantize(jpeg_params& params, storage_manager& src, storage_manager& dst)
+{
+    Raster img_raster;
+    const char* message = jpeg_peek(src, img_raster);
+    if (!message)
+        message = (img_raster.dt == ICDT_Byte) ?
+            jpeg8_requantize(params, src, dst)
+            : jpeg12_requantize(params, src, dst);
+    return jpeg_report(params, message);
+}
+
 NS_END // ICD
@@ -13,6 +13,7 @@
 #include "icd_codecs.h"
 #include "BitMask2D.h"
 #include <setjmp.h>
+#include <algorithm>
 
 NS_ICD_START
 
@@ -55,11 +56,31 @@ template<typename T> static int apply_mask(BitMap2D<> *bm, T *ps, int nc = 3, in
 
 typedef BitMap2D<> BitMask;
 
+// Reduce a mask by 2^level in each direction
+// A reduced pixel is set if any of the pixels it covers is set
+static inline void reduce_mask(const BitMask &src, BitMask &dst, int level) {
+    int w = src.getWidth();
+    int h = src.getHeight();
+    for (int y = 0; y < dst.getHeight(); y++) {
+        for (int x = 0; x < dst.getWidth(); x++) {
+            bool set = false;
+            for (int sy = y << level; !set && sy < std::min(h, (y + 1) << level); sy++)
+                for (int sx = x << level; !set && sx < std::min(w, (x + 1) << level); sx++)
+                    set = src.isSet(sx, sy);
+            dst.assign(x, y, set);
+        }
+    }
+}
+
 LIBICD_NO_EXPORT const char *jpeg8_stride_decode(codec_params &params, storage_manager &src, void *buffer);
 LIBICD_NO_EXPORT const char *jpeg8_encode(jpeg_params &params, storage_manager &src, storage_manager &dst);
+LIBICD_NO_EXPORT const char *jpeg8_requantize(jpeg_params &params, storage_manager &src, storage_manager &dst);
+LIBICD_NO_EXPORT const char *jpeg8_encode_budget(jpeg_params &params, storage_manager &src, storage_manager &dst);
 
 LIBICD_NO_EXPORT const char *jpeg12_stride_decode(codec_params &params, storage_manager &src, void *buffer);
 LIBICD_NO_EXPORT const char *jpeg12_encode(jpeg_params &params, storage_manager &src, storage_manager &dst);
+LIBICD_NO_EXPORT const char *jpeg12_requantize(jpeg_params &params, storage_manager &src, storage_manager &dst);
+LIBICD_NO_EXPORT const char *jpeg12_encode_budget(jpeg_params &params, storage_manager &src, storage_manager &dst);
 
 NS_END
 #endif
@@ -10,12 +10,24 @@
 
 #include "libicd_export.h"
 #include "icd_codecs.h"
+#include "icd_parallel.h"
 #if !defined(NEED_SWAP)
 #error Lerc 1 only works in little endian
 #endif
 
 #include "lerc1/Lerc1Image.h"
 #include <string>
+#include <limits>
+#include <type_traits>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+// SSE2 is always there on x86-64
+#if defined(__SSE2__) || defined(_M_X64)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
 
 USING_NAMESPACE_LERC1
 NS_ICD_START
@@ -27,66 +39,222 @@ void READP(T& X, const char*& p) {
     p += sizeof(X);
 }
 
-// Arbitrary epsilon
-static bool FIsEqual(float v1, float v2) {
-    return abs(v1 - v2) < 1e-12;
+// Bit i is set if p[i] == key, for 16 values
+template<typename T> static inline uint32_t match16(const T* p, T key) {
+    uint32_t m = 0;
+    for (int i = 0; i < 16; i++)
+        m |= static_cast<uint32_t>(p[i] == key) << i;
+    return m;
+}
+
+#if defined(USE_SSE2)
+template<> inline uint32_t match16(const float* p, float key) {
+    const __m128 k = _mm_set1_ps(key);
+    uint32_t m = 0;
+    for (int i = 0; i < 4; i++)
+        m |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(p + 4 * i), k))) << (4 * i);
+    return m;
+}
+
+template<> inline uint32_t match16(const int32_t* p, int32_t key) {
+    const __m128i k = _mm_set1_epi32(key);
+    auto v = reinterpret_cast<const __m128i*>(p);
+    uint32_t m = 0;
+    for (int i = 0; i < 4; i++)
+        m |= static_cast<uint32_t>(_mm_movemask_ps(_mm_castsi128_ps(
+            _mm_cmpeq_epi32(_mm_loadu_si128(v + i), k)))) << (4 * i);
+    return m;
+}
+
+template<> inline uint32_t match16(const uint32_t* p, uint32_t key) {
+    return match16(reinterpret_cast<const int32_t*>(p), static_cast<int32_t>(key));
 }
 
-template<typename T> static void Lerc1ImgFill(Lerc1Image& zImg, T* src, const lerc_params &params) {
+template<> inline uint32_t match16(const int16_t* p, int16_t key) {
+    const __m128i k = _mm_set1_epi16(key);
+    auto v = reinterpret_cast<const __m128i*>(p);
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_packs_epi16(
+        _mm_cmpeq_epi16(_mm_loadu_si128(v), k), _mm_cmpeq_epi16(_mm_loadu_si128(v + 1), k))));
+}
+
+template<> inline uint32_t match16(const uint16_t* p, uint16_t key) {
+    return match16(reinterpret_cast<const int16_t*>(p), static_cast<int16_t>(key));
+}
+
+template<> inline uint32_t match16(const uint8_t* p, uint8_t key) {
+    return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)), _mm_set1_epi8(static_cast<char>(key)))));
+}
+#endif
+
+// LERC1 mask bytes are MSB first
+static inline Lerc1NS::Byte reverse_bits(uint32_t b) {
+    b = ((b & 0xf0) >> 4) | ((b & 0x0f) << 4);
+    b = ((b & 0xcc) >> 2) | ((b & 0x33) << 2);
+    return static_cast<Lerc1NS::Byte>(((b & 0xaa) >> 1) | ((b & 0x55) << 1));
+}
+
+// The NDV as a T, clamped to the range of T, NaN is 0 for integer types
+template<typename T> static T ndv_value(double ndv) {
+    if (std::is_floating_point<T>::value)
+        return static_cast<T>(ndv);
+    if (ndv != ndv)
+        return 0;
+    return static_cast<T>(std::min(std::max(ndv, static_cast<double>(std::numeric_limits<T>::lowest())),
+        static_cast<double>(std::numeric_limits<T>::max())));
+}
+
+// The NDV as a T, false if no T value can match it
+template<typename T> static bool ndv_key(const Raster& raster, T& key) {
+    if (!raster.has_ndv)
+        return false;
+    key = ndv_value<T>(raster.ndv);
+    if (std::is_floating_point<T>::value)
+        return key == key; // Not NaN
+    return static_cast<double>(key) == raster.ndv; // Integral and in range
+}
+
+template<typename T> static bool has_key(const T* src, size_t n, T key) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16)
+        if (match16(src + i, key))
+            return true;
+    for (; i < n; i++)
+        if (src[i] == key)
+            return true;
+    return false;
+}
+
+// Pixels equal to the NDV are invalid, pixels are stride values apart
+// The mask is skipped when the NDV is not used, otherwise it is built 16 pixels at a time
+template<typename T> static void Lerc1ImgMask(Lerc1Image& zImg, const T* src, size_t stride,
+    const lerc_params &params)
+{
     auto const& rsize = params.raster.size;
-    int w = static_cast<int>(rsize.x);
-    int h = static_cast<int>(rsize.y);
-    zImg.resize(w, h);
-    const auto ndv = static_cast<float>(params.raster.ndv);
-    for (int row = 0; row < h; row++)
-        for (int col = 0; col < w; col++) {
-            auto val = static_cast<float>(*src++);
-            zImg(row, col) = val;
-            zImg.SetMask(row, col, !FIsEqual(ndv, val));
+    zImg.resizeMask(static_cast<int>(rsize.x), static_cast<int>(rsize.y));
+    size_t n = rsize.x * rsize.y;
+
+    T key;
+    if (!ndv_key(params.raster, key)) {
+        zImg.SetMask(true);
+        return;
+    }
+
+    if (stride > 1) { // Interleaved, one value at a time
+        size_t i = 0;
+        while (i < n && src[i * stride] != key)
+            i++;
+        if (i == n) {
+            zImg.SetMask(true);
+            return;
         }
+        auto bits = zImg.maskData();
+        for (i = 0; i < n; i++)
+            if (src[i * stride] != key)
+                bits[i >> 3] |= static_cast<Lerc1NS::Byte>(0x80 >> (i & 7));
+        return;
+    }
+
+    if (!has_key(src, n, key)) {
+        zImg.SetMask(true);
+        return;
+    }
+
+    // Mask bytes start as zero
+    auto bits = zImg.maskData();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint32_t valid = ~match16(src + i, key);
+        *bits++ = reverse_bits(valid & 0xff);
+        *bits++ = reverse_bits((valid >> 8) & 0xff);
+    }
+    for (int bit = 0x80; i < n; i++, bit >>= 1) {
+        if (src[i] != key)
+            *bits |= static_cast<Lerc1NS::Byte>(bit);
+        if (bit == 1) {
+            bit = 0x100;
+            bits++;
+        }
+    }
 }
 
-const char* lerc_encode(lerc_params& params, storage_manager& src, storage_manager& dst) {
-    if (params.raster.size.c != 1)
-        return "Lerc1 multi-band is not supported";
+static const char ERR_ENCODE[] = "Error during LERC1 compression";
+static const char ERR_OVERFLOW[] = "Output buffer overflow";
 
-    Lerc1Image zImg;
+// Multiple bands are written as one LERC1 per band, one after the other
+// The input is pixel interleaved, each band is read in place
+// The exact size of every band is known before anything is written, then the
+// bands are written concurrently, each one at its own offset
+// With a null dst buffer, only the size is returned, in dst.size
+template<typename T> static const char* Lerc1Encode(const T* src, lerc_params& params,
+    storage_manager& dst)
+{
+    size_t bands = params.raster.size.c;
+    int stride = static_cast<int>(bands);
+    int inner = std::max(1, params.threads / stride);
+    std::vector<Lerc1Image> images(bands);
+    std::vector<Lerc1Image::InfoFromComputeNumBytes> info(bands);
+    std::atomic<bool> ok(true);
+    parallel_for(bands, params.threads, [&](size_t b) {
+        Lerc1ImgMask(images[b], src + b, bands, params);
+        if (0 == images[b].computeNumBytesNeededToWrite(src + b, params.prec, info[b],
+            inner, stride))
+            ok = false;
+    });
+    if (!ok)
+        return ERR_ENCODE;
+
+    std::vector<size_t> offsets(bands + 1, 0);
+    for (size_t b = 0; b < bands; b++)
+        offsets[b + 1] = offsets[b] + info[b].numBytes;
+    size_t total = offsets[bands];
+    if (!dst.buffer || total > dst.size) {
+        dst.size = total; // Nothing written, this is the size needed
+        return dst.buffer ? ERR_OVERFLOW : nullptr;
+    }
 
+    parallel_for(bands, params.threads, [&](size_t b) {
+        auto pdst = reinterpret_cast<Lerc1NS::Byte*>(dst.buffer) + offsets[b];
+        size_t size = info[b].numBytes;
+        if (!images[b].write(&pdst, size, src + b, info[b], inner, stride))
+            ok = false;
+    });
+    if (!ok)
+        return ERR_ENCODE;
+    dst.size = total;
+    return nullptr;
+}
+
+const char* lerc_encode(lerc_params& params, storage_manager& src, storage_manager& dst) {
+    if (params.raster.size.c < 1)
+        return "Invalid number of bands for LERC1";
+
+    // Encodes straight from the input buffer, in its own type
     switch (params.raster.dt) {
-#define FILL(T) Lerc1ImgFill(zImg, reinterpret_cast<T *>(src.buffer), params)
-    case ICDT_Byte: FILL(uint8_t); break;
-    case ICDT_UInt16: FILL(uint16_t); break;
-    case ICDT_Int16: FILL(int16_t); break;
-    case ICDT_UInt32: FILL(uint32_t); break;
-    case ICDT_Int32: FILL(int32_t); break;
-    case ICDT_Float32: FILL(float); break;
+#define ENCODE(T) return Lerc1Encode(reinterpret_cast<const T *>(src.buffer), params, dst)
+    case ICDT_Byte: ENCODE(uint8_t);
+    case ICDT_UInt16: ENCODE(uint16_t);
+    case ICDT_Int16: ENCODE(int16_t);
+    case ICDT_UInt32: ENCODE(uint32_t);
+    case ICDT_Int32: ENCODE(int32_t);
+    case ICDT_Float32: ENCODE(float);
     default:
-        return "Unsupported data type for LERC1 encode"; // Error return
+        break;
     }
-#undef FILL
-    auto buffer = reinterpret_cast<Lerc1NS::Byte*>(dst.buffer);
-    auto pdst = buffer;
-    if (!zImg.write(&pdst, params.prec))
-        return "Error during LERC1 compression";
-    // Write advances the pdst pointer
-    auto pd = static_cast<size_t>(pdst - buffer);
-    // This is too late, better than never?
-    if (pd > dst.size)
-        return "Output buffer overflow";
-    dst.size = pd;
-    return nullptr;
+#undef ENCODE
+    return "Unsupported data type for LERC1 encode"; // Error return
 }
 
 static const char ERR_LERC[] = "Corrupt or invalid LERC1";
 static const char ERR_SMALL[] = "Input buffer too small";
 
-const char* lerc_peek(const storage_manager& src, Raster& raster)
+// Checks the headers of one LERC1 band, sets its size in bytes
+static const char* peek_band(const char* s, size_t size, Raster& raster, size_t& band_size)
 {
     auto minlerc = Lerc1Image::computeNumBytesNeededToWriteVoidImage();
-    if (src.size < minlerc)
+    if (size < minlerc)
         return ERR_SMALL;
 
-    const char* s = reinterpret_cast<char *>(src.buffer);
     std::string l1sig(s, s + 10);
     if (l1sig != "CntZImage ")
         return ERR_LERC;
@@ -103,7 +271,7 @@ const char* lerc_peek(const storage_manager& src, Raster& raster)
         return ERR_LERC;
     raster.size.x = w;
     raster.size.y = h;
-    raster.size.c = 1; // always 1 band
+    raster.size.c = 1;
 
     // Read the LERC_PREC double
     READP(raster.res, s);
@@ -121,7 +289,7 @@ const char* lerc_peek(const storage_manager& src, Raster& raster)
     if (mmval != 0.0f && mmval != 1.0f)
         return ERR_LERC;
 
-    if (static_cast<size_t>(minlerc) + msz > src.size)
+    if (static_cast<size_t>(minlerc) + msz > size)
         return ERR_SMALL;
     s += msz;
 
@@ -139,7 +307,8 @@ const char* lerc_peek(const storage_manager& src, Raster& raster)
     raster.has_max = true;
 
     // Good enough
-    if (static_cast<size_t>(minlerc - 1) + msz + dsz > src.size)
+    band_size = static_cast<size_t>(minlerc - 1) + msz + dsz;
+    if (band_size > size)
         return ERR_SMALL;
 
     raster.dt = ICDT_Float; // LERC1 can be read as anything
@@ -147,52 +316,91 @@ const char* lerc_peek(const storage_manager& src, Raster& raster)
     return nullptr;
 }
 
-template <typename T> static void Lerc1ImgUFill(Lerc1Image& zImg, 
-    const codec_params &params, T* buffer) {
-    const auto ndv = static_cast<T>(params.raster.ndv);
-    for (int row = 0; row < zImg.getHeight(); row++) {
-        auto ptr = reinterpret_cast<T*>(reinterpret_cast<char *>(buffer) 
-            + static_cast<size_t>(row) * params.line_stride);
-        for (int col = 0; col < zImg.getWidth(); col++)
-            *ptr++ = zImg.IsValid(row, col) ? static_cast<T>(zImg(row, col)) : ndv;
+// Bands follow each other, all with the same width and height, but not the same byte size
+// Bytes after the last band are ignored
+// Sets the start of each band
+static const char* lerc_bands(const storage_manager& src, Raster& raster,
+    std::vector<size_t>& offsets)
+{
+    const char* s = reinterpret_cast<char*>(src.buffer);
+    size_t band_size = 0;
+    auto message = peek_band(s, src.size, raster, band_size);
+    if (message)
+        return message;
+    offsets.assign(1, 0);
+    for (size_t off = band_size; src.size - off >= 10 && !memcmp(s + off, "CntZImage ", 10);
+        off += band_size)
+    {
+        Raster band = {};
+        message = peek_band(s + off, src.size - off, band, band_size);
+        if (message)
+            return message;
+        if (band.size.x != raster.size.x || band.size.y != raster.size.y)
+            return ERR_LERC;
+        raster.max = std::max(raster.max, band.max);
+        offsets.push_back(off);
     }
+    raster.size.c = offsets.size();
+    return nullptr;
+}
+
+const char* lerc_peek(const storage_manager& src, Raster& raster)
+{
+    std::vector<size_t> offsets;
+    return lerc_bands(src, raster, offsets);
+}
+
+// Bands are decoded concurrently, straight into the pixel interleaved output buffer
+template<typename T> static bool Lerc1Decode(const codec_params& params, const storage_manager& src,
+    const std::vector<size_t>& offsets, T* buffer)
+{
+    int bands = static_cast<int>(offsets.size());
+    int inner = std::max(1, params.threads / bands);
+    T ndv = ndv_value<T>(params.raster.ndv); // Value of invalid pixels
+    std::atomic<bool> ok(true);
+    parallel_for(offsets.size(), params.threads, [&](size_t b) {
+        auto ptr = reinterpret_cast<Lerc1NS::Byte*>(src.buffer) + offsets[b];
+        size_t size = src.size - offsets[b];
+        Lerc1Image zImg;
+        if (!zImg.read(&ptr, size, 1e12, buffer + b, params.line_stride, ndv, inner, bands))
+            ok = false;
+    });
+    return ok;
 }
 
 const char* lerc_stride_decode(codec_params& params, storage_manager& src, void* buffer) {
     auto const& rsize = params.raster.size;
-    if (rsize.c != 1)
-        return "Lerc1 multi-band is not supported";
-
+    if (params.reduction)
+        return "Reduced size decode is not supported for LERC1";
     Raster lerc_raster;
-    auto err_message = lerc_peek(src, lerc_raster);
+    std::vector<size_t> offsets;
+    auto err_message = lerc_bands(src, lerc_raster, offsets);
     if (err_message)
         return err_message;
+    if (lerc_raster.size.y != rsize.y || lerc_raster.size.x != rsize.x
+        || lerc_raster.size.c != rsize.c)
+        return "Image received has the wrong size";
 
     // Set default line stride if it wasn't specified explicitly
     if (0 == params.line_stride)
-        params.line_stride = getTypeSize(params.raster.dt, rsize.x);
-    Lerc1Image zImg;
+        params.line_stride = getTypeSize(params.raster.dt, rsize.x * rsize.c);
 
-    size_t nRemainingBytes = src.size;
-    auto ptr = reinterpret_cast<Lerc1NS::Byte*>(src.buffer);
-    if (!zImg.read(&ptr, nRemainingBytes, 1e12))
-        return "Error during LERC decompression";
-    if (static_cast<size_t>(zImg.getHeight()) != rsize.y 
-        || static_cast<size_t>(zImg.getWidth()) != rsize.x)
-        return "Image received has the wrong size";
-
-    // Got the data and the mask in zImg
-#define UFILL(T) Lerc1ImgUFill(zImg, params, reinterpret_cast<T*>(buffer))
+    // Decodes straight into the output buffer, converting to the output type
+    bool success = false;
     switch (params.raster.dt) {
-    case ICDT_Byte: UFILL(uint8_t); break;
-    case ICDT_UInt16: UFILL(uint16_t); break;
-    case ICDT_Int16: UFILL(int16_t); break;
-    case ICDT_UInt32: UFILL(uint32_t); break;
-    case ICDT_Int32: UFILL(int32_t); break;
-    case ICDT_Float: UFILL(float); break;
-    default: break;
+#define READ(T) success = Lerc1Decode(params, src, offsets, reinterpret_cast<T*>(buffer))
+    case ICDT_Byte: READ(uint8_t); break;
+    case ICDT_UInt16: READ(uint16_t); break;
+    case ICDT_Int16: READ(int16_t); break;
+    case ICDT_UInt32: READ(uint32_t); break;
+    case ICDT_Int32: READ(int32_t); break;
+    case ICDT_Float: READ(float); break;
+    default:
+        return "Unsupported data type for LERC1 decode";
     }
-#undef UFILL
+#undef READ
+    if (!success)
+        return "Error during LERC decompression";
 
     return nullptr; // Success
 }
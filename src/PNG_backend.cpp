@@ -0,0 +1,140 @@
+/*
+* PNG_backend.cpp
+* Whole buffer zlib stream compression for the in-tree PNG codec
+*
+* Tiles are always fully in memory, so single call deflate libraries can be used
+* libdeflate is used when the build finds it (USE_LIBDEFLATE), otherwise zlib
+* A zlib-ng built in compatibility mode replaces zlib without any change here
+*
+* (C)Lucian Plesea 2025
+*/
+
+#include "PNG_codec.h"
+#include <climits>
+#include <zlib.h>
+#if defined(LIBDEFLATE_FOUND)
+#include <libdeflate.h>
+#endif
+
+NS_ICD_START
+
+#if defined(LIBDEFLATE_FOUND)
+
+// Setting up a compressor is expensive, keep one per thread
+struct Compressor {
+    libdeflate_compressor* c;
+    int level;
+    Compressor() : c(nullptr), level(-1) {}
+    ~Compressor() {
+        if (c)
+            libdeflate_free_compressor(c);
+    }
+
+    libdeflate_compressor* get(int lvl) {
+        if (lvl < 0 || lvl > 12)
+            lvl = 6; // Same as zlib default
+        if (c && lvl != level) {
+            libdeflate_free_compressor(c);
+            c = nullptr;
+        }
+        if (!c)
+            c = libdeflate_alloc_compressor(lvl);
+        level = lvl;
+        return c;
+    }
+};
+
+struct Decompressor {
+    libdeflate_decompressor* d;
+    Decompressor() : d(libdeflate_alloc_decompressor()) {}
+    ~Decompressor() {
+        if (d)
+            libdeflate_free_decompressor(d);
+    }
+};
+
+static thread_local Compressor compressor;
+static thread_local Decompressor decompressor;
+
+const char* png_backend() {
+    return "libdeflate";
+}
+
+size_t png_deflate_bound(size_t len, int level)
+{
+    auto c = compressor.get(level);
+    return c ? libdeflate_zlib_compress_bound(c, len) : 0;
+}
+
+// libdeflate picks its own strategy
+size_t png_deflate(const unsigned char* src, size_t len, unsigned char* dst, size_t size,
+    int level, int)
+{
+    auto c = compressor.get(level);
+    return c ? libdeflate_zlib_compress(c, src, len, dst, size) : 0;
+}
+
+// The Adler-32 is always checked
+bool png_inflate(const unsigned char* src, size_t len, unsigned char* dst, size_t size, bool)
+{
+    // Without the actual size pointer, the output has to be exactly size bytes
+    return decompressor.d
+        && LIBDEFLATE_SUCCESS == libdeflate_zlib_decompress(decompressor.d, src, len, dst, size, nullptr);
+}
+
+#else
+
+const char* png_backend() {
+    return "zlib";
+}
+
+size_t png_deflate_bound(size_t len, int)
+{
+    return compressBound(static_cast<uLong>(len));
+}
+
+size_t png_deflate(const unsigned char* src, size_t len, unsigned char* dst, size_t size,
+    int level, int strategy)
+{
+    if (len > UINT_MAX || size > UINT_MAX)
+        return 0;
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (Z_OK != deflateInit2(&strm, level, Z_DEFLATED, 15, 8, strategy))
+        return 0;
+    strm.next_in = const_cast<Bytef*>(src);
+    strm.avail_in = static_cast<uInt>(len);
+    strm.next_out = dst;
+    strm.avail_out = static_cast<uInt>(size);
+    size_t out = (Z_STREAM_END == deflate(&strm, Z_FINISH)) ? strm.total_out : 0;
+    deflateEnd(&strm);
+    return out;
+}
+
+bool png_inflate(const unsigned char* src, size_t len, unsigned char* dst, size_t size, bool check)
+{
+    if (len > UINT_MAX || size > UINT_MAX)
+        return false;
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (Z_OK != inflateInit(&strm))
+        return false;
+#if ZLIB_VERNUM >= 0x1290
+    if (!check)
+        inflateValidate(&strm, 0);
+#else
+    (void)check;
+#endif
+    strm.next_in = const_cast<Bytef*>(src);
+    strm.avail_in = static_cast<uInt>(len);
+    strm.next_out = dst;
+    strm.avail_out = static_cast<uInt>(size);
+    // Fails if the stream doesn't fit or ends early
+    bool ok = Z_STREAM_END == inflate(&strm, Z_FINISH) && 0 == strm.avail_out;
+    inflateEnd(&strm);
+    return ok;
+}
+
+#endif
+
+NS_END
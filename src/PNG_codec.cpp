@@ -7,23 +7,26 @@
 * (C)Lucian Plesea 2016-2025
 */
 
-#include "libicd_export.h"
-#include "icd_codecs.h"
+#include "PNG_codec.h"
 #include <vector>
 #include <png.h>
-#include <string>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
 
 NS_ICD_START
 
-// TODO: Add palette PNG support, possibly other fancy options
-
 png_params::png_params(const Raster& r) : codec_params(r)
     , color_type(0)
     , bit_depth((raster.dt == ICDT_Byte) ? 8 : 16)
     , compression_level(6)
     , has_transparency(false)
+    , filter(PNGF_ADAPTIVE)
+    , strategy(PNGS_DEFAULT)
+    , palette(false)
+    , quantize(0)
+    , reduce(false)
+    , interlace(false)
 {
     assert(raster.size.c < 5);
     static int ctypes[] = {PNG_COLOR_TYPE_GRAY , PNG_COLOR_TYPE_GA , PNG_COLOR_TYPE_RGB , PNG_COLOR_TYPE_RGBA };
@@ -81,14 +84,11 @@ static void store_data(png_structp pngp, png_bytep data, png_size_t length)
 static const char ERR_PNG[] = "Corrupt or invalid PNG";
 static const char ERR_SMALL[] = "Input buffer too small";
 static const char ERR_DIFFERENT[] = "Unknown type of PNG";
+static const char ERR_CRC[] = "PNG chunk CRC error";
 
-static uint32_t readBE32(const unsigned char* src) {
-    uint32_t result = 0;
-    memcpy(&result, src, 4);
-    return be32toh(result);
-}
-
-const char* png_peek(const storage_manager& src, Raster& raster)
+// Calls fn(type, data, size) for every chunk, up to and including IEND
+// Stops at the first error, including one returned by fn
+template<typename F> static const char* walk_chunks(const storage_manager& src, bool verify, F fn)
 {
     const unsigned char* buffer = reinterpret_cast<unsigned char*>(src.buffer);
     const unsigned char* sentinel = buffer + src.size;
@@ -98,27 +98,63 @@ const char* png_peek(const storage_manager& src, Raster& raster)
         return ERR_PNG;
     buffer += 8;
 
+    // A chunk is at least 12 bytes
+    while (buffer + 12 <= sentinel) {
+        auto size = readBE32(buffer);
+        // max chunk size is 2^31 - 1, check that the data and the CRC are present
+        if (size >> 31 || size > static_cast<size_t>(sentinel - buffer) - 12)
+            return ERR_PNG;
+        const unsigned char* chunk = buffer + 4;
+        if (verify && readBE32(chunk + 4 + size) != png_crc32(0, chunk, size + 4))
+            return ERR_CRC;
+        auto message = fn(chunk, chunk + 4, size);
+        if (message)
+            return message;
+        buffer += 12 + size;
+        if (!memcmp(chunk, "IEND", 4))
+            return nullptr;
+    }
+    return ERR_SMALL;
+}
+
+const char* png_chunks(const storage_manager& src, png_chunk* index, size_t& count, bool verify)
+{
+    const unsigned char* start = reinterpret_cast<unsigned char*>(src.buffer);
+    size_t n = 0;
+    auto message = walk_chunks(src, verify,
+        [&](const unsigned char* chunk, const unsigned char* data, uint32_t size) -> const char* {
+        if (index && n < count) {
+            memcpy(index[n].type, chunk, 4);
+            index[n].length = size;
+            index[n].offset = data - start;
+        }
+        n++;
+        return nullptr;
+    });
+    count = n;
+    return message;
+}
+
+const char* png_peek(const storage_manager& src, Raster& raster)
+{
     bool seen_IHDR = false;
     bool seen_IDAT = false;
-    bool seen_IEND = false;
+    int ctype = 0;
 
-    // A chunk is at least 12 bytes
-    while (!seen_IEND && buffer + 12 <= sentinel) {
-        auto size = readBE32(buffer);
-        buffer += 4;
-        std::string chunk(buffer, buffer + 4);
-        buffer += 4;
+    auto message = walk_chunks(src, false,
+        [&](const unsigned char* chunk, const unsigned char* buffer, uint32_t size) -> const char* {
         // deal with known types of chunk
-        if (chunk == "IHDR") { // Has to be first
+        if (!memcmp(chunk, "IHDR", 4)) { // Has to be first
             if (seen_IHDR) // Only once
                 return ERR_PNG;
-            if (size != 13 || buffer + size + 4 > sentinel)
+            if (size != 13)
                 return ERR_PNG;
             raster.size.x = readBE32(buffer);
             raster.size.y = readBE32(buffer + 4);
             // Bits per sample
             auto bps = buffer[8]; // Valid values are 1, 2, 4, 8, 16, but we only handle 8 and 16
-            if (bps == 8)
+            // Palette and gray can be 1, 2, 4 or 8 bits, they get expanded to 8 bit
+            if (bps == 8 || ((buffer[9] == 0 || buffer[9] == 3) && bps < 8))
                 raster.dt = ICDT_Byte;
             else if (bps == 16)
                 raster.dt = ICDT_UInt16;
@@ -145,8 +181,9 @@ const char* png_peek(const storage_manager& src, Raster& raster)
                                         followed by an alpha sample.
             */
 
-            auto ctype = buffer[9];
-            static const uint8_t bands[] = { 1, 255, 3, 1, 2, 255, 4 };
+            ctype = buffer[9];
+            // Palette expands to RGB, or to RGBA if there is a tRNS chunk
+            static const uint8_t bands[] = { 1, 255, 3, 3, 2, 255, 4 };
             if (ctype > 6 || bands[ctype] > 4)
                 return ERR_DIFFERENT;
             raster.size.c = bands[ctype];
@@ -168,42 +205,146 @@ const char* png_peek(const storage_manager& src, Raster& raster)
             // Every other type is after IHDR
             return ERR_PNG;
         }
-        else if (chunk == "IDAT") {
+        else if (!memcmp(chunk, "tRNS", 4)) {
+            if (ctype == 3 && !seen_IDAT)
+                raster.size.c = 4;
+            // A gray key, or an RGB one with equal samples, is the NDV
+            if ((ctype == 0 && size == 2) || (ctype == 2 && size == 6
+                && !memcmp(buffer, buffer + 2, 2) && !memcmp(buffer, buffer + 4, 2))) {
+                raster.has_ndv = 1;
+                raster.ndv = (buffer[0] << 8) | buffer[1];
+            }
+        }
+        else if (!memcmp(chunk, "IDAT", 4)) {
             // Data chunk
             seen_IDAT = true;
         }
-        else if (chunk == "IEND") {
+        else if (!memcmp(chunk, "IEND", 4)) {
             // End of the PNG, should have no data
             if (size || !seen_IDAT)
                 return ERR_PNG;
-            seen_IEND = true;
         }
-
         // Ignore all the other chunk types, assume they are fine
+        return nullptr;
+    });
 
-        // Skip the chunk data, if any
-        if (size) {
-            if (size >> 31) // max chunk size is 2^31 - 1
-                return ERR_PNG;
-            buffer += size;
-            // Check that we still have enough space for the CRC
-            if (buffer + 4 > sentinel)
-                return ERR_PNG;
-        }
-
-        buffer += 4; // Skip the CRC, assume OK
-    }
-
-    if (!seen_IEND)
-        return ERR_SMALL;
+    if (message)
+        return message;
 
     // All OK
     raster.format = IMG_PNG;
     return nullptr;
 }
 
+const char* png_canvas::init(const codec_params& params, void* buf)
+{
+    static const char ERR_CANVAS[] = "Invalid PNG canvas placement";
+    buffer = static_cast<unsigned char*>(buf);
+    pixel = getTypeSize(params.raster.dt, params.raster.size.c);
+    width = static_cast<ptrdiff_t>(params.reduced(params.raster.size.x));
+    height = static_cast<ptrdiff_t>(params.reduced(params.raster.size.y));
+    x_offset = params.x_offset;
+    y_offset = params.y_offset;
+
+    // Without a canvas size, the whole tile has to fit
+    bool clip = params.canvas_x && params.canvas_y;
+    if ((params.canvas_x || params.canvas_y) && !clip)
+        return ERR_CANVAS;
+    if (!clip && (x_offset < 0 || y_offset < 0))
+        return ERR_CANVAS;
+    ptrdiff_t cx = clip ? static_cast<ptrdiff_t>(params.canvas_x) : x_offset + width;
+    ptrdiff_t cy = clip ? static_cast<ptrdiff_t>(params.canvas_y) : y_offset + height;
+    line_stride = params.line_stride ? params.line_stride : cx * pixel;
+    if (line_stride < cx * pixel)
+        return ERR_CANVAS;
+
+    x0 = std::max<ptrdiff_t>(0, -x_offset);
+    x1 = std::max(x0, std::min(width, cx - x_offset));
+    y0 = std::max<ptrdiff_t>(0, -y_offset);
+    y1 = std::max(y0, std::min(height, cy - y_offset));
+    return nullptr;
+}
+
+// Reads the rows straight into the canvas, only the visible part is written
+// With a reduction, reads the pixels at multiples of 2^reduction, a 1/2, 1/4 or 1/8
+// resolution image. For Adam7 interlaced PNGs these are the first 5, 3 or 1 passes
+// Returns true if all the image data was read
+static bool read_rows(png_structp pngp, png_infop infop, int r, const png_canvas& canvas)
+{
+    png_uint_32 width = png_get_image_width(pngp, infop);
+    png_uint_32 height = png_get_image_height(pngp, infop);
+    size_t pixel = canvas.pixel;
+    // Only needed when rows can't be read in place
+    std::vector<png_byte> row;
+    auto put = [&](png_uint_32 x, png_uint_32 y, png_const_bytep src) {
+        if (canvas.visible(x >> r, y >> r))
+            memcpy(canvas.at(x >> r, y >> r), src, pixel);
+    };
+
+    if (png_get_interlace_type(pngp, infop) == PNG_INTERLACE_NONE) {
+        // Stops after the last row needed
+        if (canvas.y1 <= canvas.y0)
+            return false;
+        png_uint_32 last = static_cast<png_uint_32>(canvas.y1 - 1) << r;
+        bool in_place = 0 == r && canvas.x0 == 0 && canvas.x1 == canvas.width;
+        for (png_uint_32 y = 0; y <= last; y++) {
+            if (in_place && canvas.visible(0, y)) {
+                png_read_row(pngp, canvas.at(0, y), nullptr);
+                continue;
+            }
+            row.resize(png_get_rowbytes(pngp, infop));
+            png_read_row(pngp, row.data(), nullptr);
+            if (y & ((1 << r) - 1) || !canvas.visible(canvas.x0, y >> r))
+                continue;
+            if (0 == r) {
+                memcpy(canvas.at(canvas.x0, y), &row[canvas.x0 * pixel],
+                    (canvas.x1 - canvas.x0) * pixel);
+                continue;
+            }
+            for (png_uint_32 x = static_cast<png_uint_32>(canvas.x0) << r;
+                x < width && (x >> r) < static_cast<png_uint_32>(canvas.x1); x += 1 << r)
+                put(x, y, &row[x * pixel]);
+        }
+        return last + 1 == height;
+    }
+
+    // Without interlace handling, libpng returns the rows of each pass, skipping empty passes
+    // The pixels of each pass row are scattered to their place
+    row.resize(png_get_rowbytes(pngp, infop));
+    for (int pass = 0; pass < 7 - 2 * r; pass++) {
+        png_uint_32 cols = PNG_PASS_COLS(width, pass);
+        if (0 == cols)
+            continue;
+        for (png_uint_32 i = 0; i < PNG_PASS_ROWS(height, pass); i++) {
+            png_read_row(pngp, row.data(), nullptr);
+            png_uint_32 y = PNG_ROW_FROM_PASS_ROW(i, pass);
+            for (png_uint_32 j = 0; j < cols; j++)
+                put(PNG_COL_FROM_PASS_COL(j, pass), y, &row[j * pixel]);
+        }
+    }
+    return 0 == r;
+}
+
 const char *png_stride_decode(codec_params &params, storage_manager &src, void *buffer)
 {
+    if (params.reduction < 0 || params.reduction > 3)
+        return "Invalid PNG reduction";
+    png_canvas canvas;
+    auto message = canvas.init(params, buffer);
+    if (message)
+        return message;
+
+    if (params.integrity == INTEGRITY_VERIFY) {
+        size_t count = 0;
+        message = png_chunks(src, nullptr, count, true);
+        if (message)
+            return message;
+    }
+
+    // The in-tree decoder handles the common cases, anything else goes to libpng
+    if (png_fast_decode(params, src, canvas))
+        return nullptr;
+
     png_structp pngp = nullptr;
     png_infop infop = nullptr;
     png_uint_32 width, height;
@@ -219,6 +360,13 @@ const char *png_stride_decode(codec_params &params, storage_manager &src, void *
         return params.error_message;
 
     png_set_read_fn(pngp, &src, get_data);
+    // CRCs are already checked for VERIFY, and not needed for TRUSTED
+    if (params.integrity != INTEGRITY_DEFAULT)
+        png_set_crc_action(pngp, PNG_CRC_QUIET_USE, PNG_CRC_QUIET_USE);
+#if defined(PNG_IGNORE_ADLER32)
+    if (params.integrity == INTEGRITY_TRUSTED)
+        png_set_option(pngp, PNG_IGNORE_ADLER32, PNG_OPTION_ON);
+#endif
 
     // This reads all chunks up to the first IDAT
     png_read_info(pngp, infop);
@@ -232,6 +380,40 @@ const char *png_stride_decode(codec_params &params, storage_manager &src, void *
         longjmp(png_jmpbuf(pngp), 1);
     }
 
+    // Expand palette, low bit depth gray, missing color or alpha to the requested bands
+    // Alpha comes from tRNS, or is opaque
+    size_t bands = params.raster.size.c;
+    if (ct == PNG_COLOR_TYPE_PALETTE) {
+        // This also expands tRNS to alpha, which is dropped when not requested
+        png_set_palette_to_rgb(pngp);
+        ct = PNG_COLOR_TYPE_RGB;
+        if (png_get_valid(pngp, infop, PNG_INFO_tRNS)) {
+            if (bands % 2 == 0)
+                ct = PNG_COLOR_TYPE_RGB_ALPHA;
+            else
+                png_set_strip_alpha(pngp);
+        }
+        bit_depth = 8;
+    }
+    if (bit_depth < 8) {
+        png_set_expand_gray_1_2_4_to_8(pngp);
+        bit_depth = 8;
+    }
+    bool has_color = (ct & PNG_COLOR_MASK_COLOR) != 0;
+    bool has_alpha = (ct & PNG_COLOR_MASK_ALPHA) != 0;
+    if (bands < 1 || bands > 4 || (has_color && bands < 3) || (has_alpha && bands % 2)) {
+        strcpy(params.error_message, "Input PNG has more bands than requested");
+        longjmp(png_jmpbuf(pngp), 1);
+    }
+    if (!has_color && bands > 2)
+        png_set_gray_to_rgb(pngp);
+    if (!has_alpha && bands % 2 == 0) {
+        if (png_get_valid(pngp, infop, PNG_INFO_tRNS))
+            png_set_tRNS_to_alpha(pngp);
+        else
+            png_set_add_alpha(pngp, (bit_depth > 8) ? 0xffff : 0xff, PNG_FILLER_AFTER);
+    }
+
     if ((params.raster.dt == ICDT_Byte && bit_depth != 8) ||
         ((params.raster.dt == ICDT_UInt16 || params.raster.dt == ICDT_Int16) && bit_depth != 16)) {
         strcpy(params.error_message, "Input PNG has the wrong type");
@@ -243,44 +425,29 @@ const char *png_stride_decode(codec_params &params, storage_manager &src, void *
         png_set_swap(pngp);
 #endif
 
-    // TODO: Decode to expected format
-    // png_set_palette_to_rgb(pngp); // Palette to RGB
-    // png_set_tRNS_to_alpha(pngp); // transparency to Alpha
-    // png_set_add_alpha(pngp, 255, PNG_FILTER_AFTER); // Add alpha if not there
     // Call this after using any of the png_set_*
     png_read_update_info(pngp, infop);
 
-    auto line_stride = static_cast<png_size_t>(params.line_stride);
-    if (0 == line_stride)
-        line_stride = png_get_rowbytes(pngp, infop);
-
-    std::vector<png_bytep> png_rowp(rsize.y);
-    for (size_t i = 0; i < png_rowp.size(); i++) // line_stride is always in bytes
-        png_rowp[i] = reinterpret_cast<png_bytep>(
-            static_cast<char*>(buffer) + i * line_stride);
-
-    png_read_image(pngp, png_rowp.data());
-    png_read_end(pngp, infop);
+    // The rest of the PNG is only read if all the image was needed
+    if (read_rows(pngp, infop, params.reduction, canvas))
+        png_read_end(pngp, infop);
     png_destroy_read_struct(&pngp, &infop, 0);
-
     return nullptr;
 }
 
-const char *png_encode(png_params &params, storage_manager &src, storage_manager &dst)
+// Encodes src as described by params, red is set for reduced images
+static const char *png_write(png_params &params, storage_manager &src, storage_manager &dst,
+    const png_reduced *red)
 {
+    // The in-tree encoder doesn't interlace
+    if (!params.interlace)
+        return png_parallel_encode(params, src, dst, red);
+
     png_structp pngp = nullptr;
     png_infop infop = nullptr;
     auto const& rsize = params.raster.size;
     png_uint_32 width = static_cast<png_uint_32>(rsize.x);
     png_uint_32 height = static_cast<png_uint_32>(rsize.y);
-    // Check inputs for sanity
-    if (getTypeSize(params.raster.dt) > 2)
-        return "Invalid PNG encoding data type";
-    if (rsize.x * rsize.y * getTypeSize(params.raster.dt) > src.size)
-        return "Insufficient input data for PNG encoding";
-    // Use a vector so it cleans up itself
-    std::vector<png_bytep> png_rowp(height);
-
     // To avoid changing the buffer pointer
     storage_manager mgr = dst;
 
@@ -295,35 +462,71 @@ const char *png_encode(png_params &params, storage_manager &src, storage_manager
 
     png_set_write_fn(pngp, &mgr, store_data, flush_png);
     png_set_IHDR(pngp, infop, width, height, params.bit_depth, params.color_type,
-        PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+        params.interlace ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
     png_set_compression_level(pngp, params.compression_level);
-
+    int filter, strategy;
+    png_tune(params, src, filter, strategy);
+    if (filter >= 0)
+        png_set_filter(pngp, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE << filter);
+    png_set_compression_strategy(pngp, strategy);
+
+    if (red && !red->plte.empty()) {
+        png_set_PLTE(pngp, infop, reinterpret_cast<png_const_colorp>(red->plte.data()),
+            static_cast<int>(red->plte.size() / 3));
+        if (!red->trns.empty())
+            png_set_tRNS(pngp, infop, red->trns.data(), static_cast<int>(red->trns.size()), nullptr);
+    }
+    else if (red) {
+        // Color key, big endian samples
+        if (!red->trns.empty()) {
+            png_color_16 tcolor;
+            memset(&tcolor, 0, sizeof(png_color_16));
+            png_uint_16 key[3] = {};
+            for (size_t i = 0; i < red->trns.size() / 2; i++)
+                key[i] = static_cast<png_uint_16>((red->trns[2 * i] << 8) | red->trns[2 * i + 1]);
+            tcolor.gray = tcolor.red = key[0];
+            tcolor.green = key[1];
+            tcolor.blue = key[2];
+            png_set_tRNS(pngp, infop, 0, 0, &tcolor);
+        }
+    }
     // Flag NDV as transparent color
-    if (params.has_transparency) {
-        // TODO: Pass the transparent color via params.
-        // For now, 0 is the no data value, regardless of the type of data
-
+    else if (params.has_transparency && !(params.color_type & PNG_COLOR_MASK_ALPHA)) {
         png_color_16 tcolor;
         memset(&tcolor, 0, sizeof(png_color_16));
+        tcolor.gray = tcolor.red = tcolor.green = tcolor.blue = png_key(params);
         png_set_tRNS(pngp, infop, 0, 0, &tcolor);
     }
 
-#if defined(NEED_SWAP)
-    if (params.bit_depth > 8)
-        png_set_swap(pngp);
-#endif
-
     auto rowbytes = png_get_rowbytes(pngp, infop);
-    for (size_t i = 0; i < png_rowp.size(); i++)
-        png_rowp[i] = reinterpret_cast<png_bytep>(src.buffer) + i * rowbytes;
     // Last check, do we have enough input
-    if (png_rowp.size() * rowbytes > src.size) {
+    if (height * rowbytes > src.size) {
         png_destroy_write_struct(&pngp, &infop);
         return "Insufficient input data for PNG encoding";
     }
 
     png_write_info(pngp, infop);
-    png_write_image(pngp, png_rowp.data());
+    // Rows are written one at a time, 16 bit ones are swapped to PNG order in a reusable
+    // buffer, which is faster than the libpng swap
+    int passes = png_set_interlace_handling(pngp);
+#if defined(NEED_SWAP)
+    bool swap = params.bit_depth > 8;
+#else
+    bool swap = false;
+#endif
+    std::vector<png_byte> row(swap ? rowbytes : 0);
+    for (int pass = 0; pass < passes; pass++) {
+        for (png_uint_32 y = 0; y < height; y++) {
+            png_const_bytep line = reinterpret_cast<png_const_bytep>(src.buffer) + y * rowbytes;
+            // Interlaced passes skip rows
+            if (swap && (passes == 1 || PNG_ROW_IN_INTERLACE_PASS(y, pass))) {
+                png_swap16(row.data(), line, rowbytes);
+                line = row.data();
+            }
+            png_write_row(pngp, line);
+        }
+    }
     png_write_end(pngp, infop);
 
     png_destroy_write_struct(&pngp, &infop);
@@ -332,6 +535,38 @@ const char *png_encode(png_params &params, storage_manager &src, storage_manager
     return nullptr;
 }
 
+const char *png_encode(png_params &params, storage_manager &src, storage_manager &dst)
+{
+    auto const& rsize = params.raster.size;
+    // Check inputs for sanity
+    if (getTypeSize(params.raster.dt) > 2)
+        return "Invalid PNG encoding data type";
+    if (rsize.x * rsize.y * rsize.c * getTypeSize(params.raster.dt) > src.size)
+        return "Insufficient input data for PNG encoding";
+
+    // Smaller layout, a gray image is better than a palette one
+    png_reduced red;
+    bool reduced = params.reduce && png_reduce(params, src, red);
+    if (params.palette && !(reduced && red.color_type == PNG_COLOR_TYPE_GRAY))
+        reduced = png_palettize(params, src, red) || reduced;
+    if (!reduced)
+        return png_write(params, src, dst, nullptr);
+
+    static const int bands[] = { 1, 0, 3, 1, 2, 0, 4 };
+    png_params ip(params);
+    ip.raster.size.c = bands[red.color_type];
+    ip.color_type = red.color_type;
+    ip.bit_depth = red.depth;
+    ip.has_transparency = false; // Part of red
+    storage_manager isrc(red.rows.data(), red.rows.size());
+    auto message = png_write(ip, isrc, dst, &red);
+    if (!message)
+        return nullptr;
+    // Might be in ip
+    strncpy(params.error_message, message, sizeof(params.error_message) - 1);
+    return params.error_message;
+}
+
 int set_png_params(const Raster &raster, png_params *params) {
     // Pick some defaults
     // Only handles 8 or 16 bits
@@ -0,0 +1,134 @@
+/*
+* PNG_codec.h
+*
+* Shared code for the AHTSE PNG codec
+*
+* (C) Lucian Plesea 2016-2025
+*/
+
+#if !defined(PNG_CODEC_H)
+#define PNG_CODEC_H
+
+#include "libicd_export.h"
+#include "icd_codecs.h"
+#include <cstring>
+#include <cstdlib>
+#include <vector>
+
+NS_ICD_START
+
+// PNG is big endian
+static inline uint32_t readBE32(const unsigned char* src) {
+    uint32_t result = 0;
+    memcpy(&result, src, 4);
+    return be32toh(result);
+}
+
+static const unsigned char PNG_SIGNATURE[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+// PNG filter types
+enum { FILT_NONE = 0, FILT_SUB, FILT_UP, FILT_AVG, FILT_PAETH };
+
+// Paeth predictor, from the left, up and upper left samples
+static inline int paeth(int a, int b, int c) {
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - 2 * c);
+    return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+// Destination of the decoded pixels, a tile placed in a canvas
+// Coordinates are in decoded tile pixels, only the visible part gets written
+struct png_canvas {
+    unsigned char* buffer;
+    size_t line_stride;
+    size_t pixel; // Bytes per output pixel
+    ptrdiff_t width, height;
+    ptrdiff_t x_offset, y_offset;
+    ptrdiff_t x0, x1, y0, y1; // Visible part of the tile, can be empty
+
+    // In PNG_codec.cpp, returns an error message if the placement is not valid
+    LIBICD_NO_EXPORT const char* init(const codec_params& params, void* buf);
+
+    bool whole() const {
+        return x0 == 0 && y0 == 0 && x1 == width && y1 == height;
+    }
+
+    bool visible(ptrdiff_t x, ptrdiff_t y) const {
+        return x0 <= x && x < x1 && y0 <= y && y < y1;
+    }
+
+    // Output location of a visible pixel
+    unsigned char* at(ptrdiff_t x, ptrdiff_t y) const {
+        return buffer + (y + y_offset) * line_stride + (x + x_offset) * pixel;
+    }
+};
+
+// In PNG_crc.cpp
+// CRC-32 as used by PNG and zlib, start with a crc of 0
+LIBICD_NO_EXPORT uint32_t png_crc32(uint32_t crc, const unsigned char* buf, size_t len);
+
+// In PNG_backend.cpp
+// Whole buffer zlib streams, using the deflate library picked at build time
+// Upper bound of the compressed size
+LIBICD_NO_EXPORT size_t png_deflate_bound(size_t len, int level);
+// Returns the size of the zlib stream written to dst, 0 on failure
+LIBICD_NO_EXPORT size_t png_deflate(const unsigned char* src, size_t len, unsigned char* dst,
+    size_t size, int level, int strategy);
+// The stream has to decompress to exactly size bytes, the Adler-32 can be skipped if check is false
+LIBICD_NO_EXPORT bool png_inflate(const unsigned char* src, size_t len, unsigned char* dst,
+    size_t size, bool check);
+
+// The transparent sample value, from the NDV when it fits the data type, otherwise 0
+static inline uint16_t png_key(const png_params& params) {
+    const Raster& r = params.raster;
+    double lo = (r.dt == ICDT_Int16) ? -32768 : 0;
+    double hi = (r.dt == ICDT_Byte) ? 255 : (r.dt == ICDT_Int16) ? 32767 : 65535;
+    if (!r.has_ndv || !(r.ndv >= lo && r.ndv <= hi))
+        return 0;
+    return static_cast<uint16_t>(static_cast<int32_t>(r.ndv));
+}
+
+// In PNG_inflate.cpp
+// Copy 16 bit samples between PNG and native order, a plain copy on big endian hosts
+LIBICD_NO_EXPORT void png_swap16(unsigned char* dst, const unsigned char* src, size_t len);
+// In-tree decoder for 8 and 16 bit, non-palette, non-interlaced PNGs
+// Returns false if the input is not handled, the caller should use libpng
+// IDAT CRCs are checked only for INTEGRITY_DEFAULT
+LIBICD_NO_EXPORT bool png_fast_decode(codec_params& params, const storage_manager& src,
+    const png_canvas& canvas);
+
+// Image encoded in a different layout than the input, smaller
+struct png_reduced {
+    std::vector<unsigned char> plte; // RGB triplets, palette images only
+    std::vector<unsigned char> trns; // tRNS chunk content, if any
+    std::vector<unsigned char> rows; // Packed rows, 16 bit samples in native order
+    int color_type;
+    int depth; // Bits per sample
+};
+
+// In PNG_palette.cpp
+// Builds the palette of an 8 bit RGB or RGBA image
+// Returns false if there are more than 256 colors and params.quantize is not set
+LIBICD_NO_EXPORT bool png_palettize(const png_params& params, const storage_manager& src,
+    png_reduced& pal);
+
+// In PNG_reduce.cpp
+// Picks the smallest color type and bit depth that holds the image exactly
+// Returns false if that is the input layout
+LIBICD_NO_EXPORT bool png_reduce(const png_params& params, const storage_manager& src,
+    png_reduced& red);
+
+// In PNG_deflate.cpp
+// Resolves params.filter and params.strategy, analyzing the input for the AUTO values
+// filter is a PNG filter type, or -1 for a per row choice, strategy is a zlib strategy
+LIBICD_NO_EXPORT void png_tune(const png_params& params, const storage_manager& src,
+    int& filter, int& strategy);
+// Multithreaded encoder, uses params.threads, output is a standard PNG
+// A single thread encode uses the deflate backend
+// For reduced images, src holds the rows and red the extra chunks
+LIBICD_NO_EXPORT const char* png_parallel_encode(png_params& params, storage_manager& src,
+    storage_manager& dst, const png_reduced* red);
+
+NS_END
+#endif
@@ -0,0 +1,119 @@
+/*
+* PNG_crc.cpp
+* CRC-32 for PNG chunks, hardware accelerated when possible
+*
+* x86-64 folds 64 bytes at a time with carry-less multiplication (PCLMULQDQ),
+* as described in the Intel paper "Fast CRC Computation for Generic Polynomials
+* Using PCLMULQDQ Instruction", selected at run time
+* ARMv8 uses the CRC32 instructions, when the compiler targets them
+* Everything else, including the short tails, uses zlib
+*
+* (C)Lucian Plesea 2025
+*/
+
+#include "PNG_codec.h"
+#include <zlib.h>
+
+#if (defined(__x86_64__) || defined(_M_X64)) && (defined(__GNUC__) || defined(_MSC_VER))
+#define USE_PCLMUL
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_PCLMUL
+#else
+#define TARGET_PCLMUL __attribute__((target("pclmul,sse4.1")))
+#endif
+#elif defined(__ARM_FEATURE_CRC32)
+#define USE_ARMCRC
+#include <arm_acle.h>
+#endif
+
+NS_ICD_START
+
+#if defined(USE_PCLMUL)
+// Folds x over the next 128 bits
+TARGET_PCLMUL static inline __m128i fold(__m128i x, __m128i next, __m128i k) {
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), next),
+        _mm_clmulepi64_si128(x, k, 0x00));
+}
+
+// Folds len bytes into the inverted crc, len is a multiple of 16, at least 64
+TARGET_PCLMUL static uint32_t crc32_pclmul(uint32_t crc, const unsigned char* buf, size_t len)
+{
+    // Bit reflected fold constants and the Barrett reduction constants for CRC-32
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i* p = reinterpret_cast<const __m128i*>(buf);
+
+    __m128i x1 = _mm_loadu_si128(p);
+    __m128i x2 = _mm_loadu_si128(p + 1);
+    __m128i x3 = _mm_loadu_si128(p + 2);
+    __m128i x4 = _mm_loadu_si128(p + 3);
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(crc)));
+    p += 4;
+    len -= 64;
+
+    // Four parallel folds, 64 bytes at a time
+    for (; len >= 64; len -= 64, p += 4) {
+        x1 = fold(x1, _mm_loadu_si128(p), k1k2);
+        x2 = fold(x2, _mm_loadu_si128(p + 1), k1k2);
+        x3 = fold(x3, _mm_loadu_si128(p + 2), k1k2);
+        x4 = fold(x4, _mm_loadu_si128(p + 3), k1k2);
+    }
+
+    // Fold into 128 bits
+    x1 = fold(x1, x2, k3k4);
+    x1 = fold(x1, x3, k3k4);
+    x1 = fold(x1, x4, k3k4);
+    for (; len >= 16; len -= 16)
+        x1 = fold(x1, _mm_loadu_si128(p++), k3k4);
+
+    // Fold 128 bits to 64, then Barrett reduce to 32
+    const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k5k0, 0x00), x2);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), poly, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), poly, 0x00);
+    return static_cast<uint32_t>(_mm_extract_epi32(_mm_xor_si128(x1, x2), 1));
+}
+
+static bool has_pclmul() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 1)) && (info[2] & (1 << 19)); // PCLMULQDQ and SSE4.1
+#else
+    return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+#endif
+
+uint32_t png_crc32(uint32_t crc, const unsigned char* buf, size_t len)
+{
+#if defined(USE_PCLMUL)
+    static const bool pclmul = has_pclmul();
+    if (pclmul && len >= 64) {
+        size_t n = len & ~static_cast<size_t>(15);
+        crc = ~crc32_pclmul(~crc, buf, n);
+        buf += n;
+        len -= n;
+    }
+#elif defined(USE_ARMCRC)
+    crc = ~crc;
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint64_t v;
+        memcpy(&v, buf, 8);
+        crc = __crc32d(crc, v);
+    }
+    for (; len; len--)
+        crc = __crc32b(crc, *buf++);
+    crc = ~crc;
+#endif
+    return len ? static_cast<uint32_t>(crc32(crc, buf, static_cast<uInt>(len))) : crc;
+}
+
+NS_END
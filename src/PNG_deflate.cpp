@@ -0,0 +1,412 @@
+/*
+* PNG_deflate.cpp
+* In-tree parallel PNG encoder and encoding parameter selection
+*
+* Rows are filtered in parallel, then blocks of rows are deflated independently,
+* each one primed with the previous 32KB of the stream as a dictionary
+* The blocks end with a sync flush, so they concatenate into a single zlib stream
+* The Adler-32 checksums of the blocks are combined into the stream one
+* A single thread encode is one whole buffer call to the deflate backend instead
+* The output is a standard PNG, readable by any decoder
+*
+* (C)Lucian Plesea 2025
+*/
+
+#include "PNG_codec.h"
+#include "icd_parallel.h"
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
+#include <zlib.h>
+
+NS_ICD_START
+
+// Uncompressed bytes per deflate block
+static const size_t BLOCK_SIZE = 256 * 1024;
+// Deflate window
+static const size_t WINDOW_SIZE = 32 * 1024;
+
+// Apply one filter to a row, prev is the previous raw row or zeros
+// Returns the sum of the absolute values of the output, as signed bytes
+static size_t filter_row(int filter, const unsigned char* row, const unsigned char* prev,
+    unsigned char* out, size_t len, size_t bpp)
+{
+    size_t i = 0;
+    switch (filter) {
+    case FILT_NONE:
+        memcpy(out, row, len);
+        break;
+    case FILT_SUB:
+        for (; i < bpp; i++)
+            out[i] = row[i];
+        for (; i < len; i++)
+            out[i] = row[i] - row[i - bpp];
+        break;
+    case FILT_UP:
+        for (; i < len; i++)
+            out[i] = row[i] - prev[i];
+        break;
+    case FILT_AVG:
+        for (; i < bpp; i++)
+            out[i] = row[i] - (prev[i] >> 1);
+        for (; i < len; i++)
+            out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+        break;
+    case FILT_PAETH:
+        for (; i < bpp; i++)
+            out[i] = row[i] - prev[i];
+        for (; i < len; i++)
+            out[i] = row[i] - paeth(row[i - bpp], prev[i], prev[i - bpp]);
+        break;
+    }
+
+    size_t sum = 0;
+    for (i = 0; i < len; i++)
+        sum += abs(static_cast<signed char>(out[i]));
+    return sum;
+}
+
+// Pick the filter with the lowest sum of absolute values, same heuristic as libpng
+// out has room for the filter byte and the row
+static void filter_adaptive(const unsigned char* row, const unsigned char* prev,
+    unsigned char* out, unsigned char* scratch, size_t len, size_t bpp)
+{
+    size_t best = filter_row(FILT_NONE, row, prev, out + 1, len, bpp);
+    out[0] = FILT_NONE;
+    for (int f = FILT_SUB; f <= FILT_PAETH; f++) {
+        size_t sum = filter_row(f, row, prev, scratch, len, bpp);
+        if (sum < best) {
+            best = sum;
+            out[0] = static_cast<unsigned char>(f);
+            memcpy(out + 1, scratch, len);
+        }
+    }
+}
+
+// The AUTO settings are picked on a few strips of consecutive rows
+static const size_t SAMPLE_STRIPS = 4;
+static const size_t STRIP_ROWS = 8;
+
+// Size of the deflated sample with a given strategy
+static size_t trial_size(const std::vector<unsigned char>& sample, int level, int strategy) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (Z_OK != deflateInit2(&strm, level, Z_DEFLATED, -15, 8, strategy))
+        return ~static_cast<size_t>(0);
+    std::vector<unsigned char> out(deflateBound(&strm, static_cast<uLong>(sample.size())));
+    strm.next_in = const_cast<Bytef*>(sample.data());
+    strm.avail_in = static_cast<uInt>(sample.size());
+    strm.next_out = out.data();
+    strm.avail_out = static_cast<uInt>(out.size());
+    size_t result = (Z_STREAM_END == deflate(&strm, Z_FINISH)) ? strm.total_out
+        : ~static_cast<size_t>(0);
+    deflateEnd(&strm);
+    return result;
+}
+
+void png_tune(const png_params& params, const storage_manager& src, int& filter, int& strategy)
+{
+    static const int filters[] = { -1, FILT_NONE, FILT_SUB, FILT_UP, -1 };
+    static const int strategies[] = { Z_FILTERED, Z_FILTERED, Z_RLE, Z_HUFFMAN_ONLY, Z_FILTERED };
+    filter = filters[params.filter];
+    strategy = strategies[params.strategy];
+    // Same as libpng, palette and low bit depth images are not filtered by default
+    if (params.filter == PNGF_ADAPTIVE && (params.color_type == 3 || params.bit_depth < 8))
+        filter = FILT_NONE;
+    // and unfiltered data uses the default strategy
+    if (params.strategy == PNGS_DEFAULT && filter == FILT_NONE)
+        strategy = Z_DEFAULT_STRATEGY;
+    if (params.filter != PNGF_AUTO && params.strategy != PNGS_AUTO)
+        return;
+
+    auto const& rsize = params.raster.size;
+    size_t bpp = std::max<size_t>(1, rsize.c * params.bit_depth / 8);
+    size_t rowbytes = (rsize.x * rsize.c * params.bit_depth + 7) / 8;
+    size_t strip = std::min<size_t>(STRIP_ROWS, rsize.y);
+    size_t nstrips = std::min<size_t>(SAMPLE_STRIPS, rsize.y / strip);
+    if (0 == rowbytes || 0 == strip)
+        return;
+
+    // Copy of the sampled rows in PNG byte order, each strip preceded by the row above
+    std::vector<unsigned char> rows((strip + 1) * nstrips * rowbytes);
+    const unsigned char* raw = reinterpret_cast<const unsigned char*>(src.buffer);
+    for (size_t s = 0; s < nstrips; s++) {
+        size_t y0 = s * rsize.y / nstrips;
+        unsigned char* dst = &rows[s * (strip + 1) * rowbytes];
+        for (size_t y = y0; y < y0 + strip + 1; y++, dst += rowbytes) {
+            if (y == 0) // Above the first row
+                continue;
+            const unsigned char* line = raw + (y - 1) * rowbytes;
+#if defined(NEED_SWAP)
+            if (params.bit_depth > 8) {
+                for (size_t j = 0; j < rowbytes; j += 2) {
+                    dst[j] = line[j + 1];
+                    dst[j + 1] = line[j];
+                }
+                continue;
+            }
+#endif
+            memcpy(dst, line, rowbytes);
+        }
+    }
+
+    // Current row in rows, skipping the ones above the strips
+    auto sample_row = [&](size_t i) {
+        return &rows[((i / strip) * (strip + 1) + i % strip + 1) * rowbytes];
+    };
+    std::vector<unsigned char> scratch(rowbytes);
+    if (params.filter == PNGF_AUTO) {
+        // The filter with the smallest residuals
+        size_t sums[FILT_PAETH + 1] = {};
+        for (size_t i = 0; i < strip * nstrips; i++) {
+            unsigned char* row = sample_row(i);
+            for (int f = FILT_NONE; f <= FILT_PAETH; f++)
+                sums[f] += filter_row(f, row, row - rowbytes, scratch.data(), rowbytes, bpp);
+        }
+        filter = static_cast<int>(std::min_element(sums, sums + FILT_PAETH + 1) - sums);
+    }
+    if (params.strategy != PNGS_AUTO)
+        return;
+
+    // Try each strategy on the filtered sample
+    size_t linelen = rowbytes + 1;
+    std::vector<unsigned char> sample(strip * nstrips * linelen);
+    for (size_t i = 0; i < strip * nstrips; i++) {
+        unsigned char* row = sample_row(i);
+        unsigned char* out = &sample[i * linelen];
+        if (filter < 0) {
+            filter_adaptive(row, row - rowbytes, out, scratch.data(), rowbytes, bpp);
+            continue;
+        }
+        out[0] = static_cast<unsigned char>(filter);
+        filter_row(filter, row, row - rowbytes, out + 1, rowbytes, bpp);
+    }
+
+    // Faster first, a slower one has to be at least 5% smaller to be picked
+    static const int candidates[] = { Z_HUFFMAN_ONLY, Z_RLE, Z_FILTERED };
+    size_t best = ~static_cast<size_t>(0);
+    for (int c : candidates) {
+        size_t sz = trial_size(sample, params.compression_level, c);
+        if (sz < best - best / 20) {
+            best = sz;
+            strategy = c;
+        }
+    }
+}
+
+// Appends PNG chunks to a storage manager, false if it doesn't fit
+struct ChunkWriter {
+    unsigned char* ptr;
+    size_t left;
+    uint32_t crc = 0;
+    unsigned char* start; // of current chunk
+
+    bool put(const void* data, size_t len) {
+        if (len > left)
+            return false;
+        memcpy(ptr, data, len);
+        crc = png_crc32(crc, ptr, len);
+        ptr += len;
+        left -= len;
+        return true;
+    }
+
+    bool put32(uint32_t v) {
+        v = htobe32(v);
+        return put(&v, 4);
+    }
+
+    bool begin(const char* type) {
+        if (left < 8)
+            return false;
+        start = ptr;
+        ptr += 4; // Size, filled in by end()
+        left -= 4;
+        crc = 0;
+        return put(type, 4);
+    }
+
+    bool end() {
+        uint32_t len = htobe32(static_cast<uint32_t>(ptr - start - 8));
+        memcpy(start, &len, 4);
+        return put32(crc);
+    }
+};
+
+const char* png_parallel_encode(png_params& params, storage_manager& src, storage_manager& dst,
+    const png_reduced* red)
+{
+    auto const& rsize = params.raster.size;
+    size_t bpp = std::max<size_t>(1, rsize.c * params.bit_depth / 8);
+    size_t rowbytes = (rsize.x * rsize.c * params.bit_depth + 7) / 8;
+    size_t height = rsize.y;
+    if (rowbytes * height > src.size)
+        return "Insufficient input data for PNG encoding";
+
+    int filter, strategy;
+    png_tune(params, src, filter, strategy);
+
+    // Filter all the rows, prefixed by the filter byte
+    size_t linelen = rowbytes + 1;
+    std::vector<unsigned char> filtered(linelen * height);
+    const std::vector<unsigned char> zeros(rowbytes);
+    const unsigned char* raw = reinterpret_cast<const unsigned char*>(src.buffer);
+    size_t nblocks = std::max<size_t>(1, (filtered.size() + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    size_t block_rows = (height + nblocks - 1) / nblocks;
+    nblocks = (height + block_rows - 1) / block_rows;
+
+#if defined(NEED_SWAP)
+    bool swap = params.bit_depth > 8;
+#else
+    bool swap = false;
+#endif
+
+    parallel_for(nblocks, params.threads, [&](size_t b) {
+        std::vector<unsigned char> scratch(rowbytes);
+        // 16 bit rows are swapped to PNG order as they are filtered, in two alternating rows
+        std::vector<unsigned char> swapped(swap ? 2 * rowbytes : 0);
+        auto line = [&](size_t y) {
+            const unsigned char* p = raw + y * rowbytes;
+            if (!swap)
+                return p;
+            unsigned char* s = &swapped[(y & 1) * rowbytes];
+            png_swap16(s, p, rowbytes);
+            return static_cast<const unsigned char*>(s);
+        };
+        size_t y0 = b * block_rows;
+        const unsigned char* prev = y0 ? line(y0 - 1) : zeros.data();
+        for (size_t y = y0; y < std::min(height, y0 + block_rows); y++) {
+            const unsigned char* cur = line(y);
+            unsigned char* out = &filtered[y * linelen];
+            if (filter < 0)
+                filter_adaptive(cur, prev, out, scratch.data(), rowbytes, bpp);
+            else {
+                out[0] = static_cast<unsigned char>(filter);
+                filter_row(filter, cur, prev, out + 1, rowbytes, bpp);
+            }
+            prev = cur;
+        }
+    });
+
+    // IDAT contents, the zlib header and the checksum are added for blocks
+    std::vector<std::vector<unsigned char>> out;
+    bool whole = false;
+    unsigned char zh[2] = {};
+    uLong check = 0;
+    // Single thread, the backend makes the complete stream in one IDAT
+    if (params.threads <= 1) {
+        whole = true;
+        out.resize(1);
+        out[0].resize(png_deflate_bound(filtered.size(), params.compression_level));
+        size_t zlen = png_deflate(filtered.data(), filtered.size(), out[0].data(), out[0].size(),
+            params.compression_level, strategy);
+        if (0 == zlen)
+            return "PNG compression error";
+        out[0].resize(zlen);
+    }
+
+    if (!whole) {
+        // Deflate the blocks
+        out.resize(nblocks);
+        std::vector<uLong> adler(nblocks);
+        std::atomic<bool> failed(false);
+        parallel_for(nblocks, params.threads, [&](size_t b) {
+            size_t first = b * block_rows * linelen;
+            size_t len = std::min(height, (b + 1) * block_rows) * linelen - first;
+            const unsigned char* data = filtered.data() + first;
+            adler[b] = adler32(adler32(0, nullptr, 0), data, static_cast<uInt>(len));
+
+            z_stream strm;
+            memset(&strm, 0, sizeof(strm));
+            if (Z_OK != deflateInit2(&strm, params.compression_level, Z_DEFLATED, -15, 8,
+                strategy)) {
+                failed = true;
+                return;
+            }
+            // Previous window as dictionary, matches what the decoder has seen
+            if (first) {
+                size_t dlen = std::min(first, WINDOW_SIZE);
+                deflateSetDictionary(&strm, data - dlen, static_cast<uInt>(dlen));
+            }
+            out[b].resize(deflateBound(&strm, static_cast<uLong>(len)) + 16);
+            strm.next_in = const_cast<Bytef*>(data);
+            strm.avail_in = static_cast<uInt>(len);
+            strm.next_out = out[b].data();
+            strm.avail_out = static_cast<uInt>(out[b].size());
+            int ret = deflate(&strm, (b + 1 == nblocks) ? Z_FINISH : Z_SYNC_FLUSH);
+            if (ret != ((b + 1 == nblocks) ? Z_STREAM_END : Z_OK) || strm.avail_in)
+                failed = true;
+            out[b].resize(strm.total_out);
+            deflateEnd(&strm);
+        });
+        if (failed)
+            return "PNG compression error";
+
+        // Zlib header, 32K window and the compression level hint
+        int level = params.compression_level;
+        unsigned int flevel = (level < 0) ? 2 : (level < 2) ? 0 : (level < 6) ? 1 : (level == 6) ? 2 : 3;
+        unsigned int zhdr = (0x78 << 8) | (flevel << 6);
+        zhdr += 31 - zhdr % 31;
+        zh[0] = static_cast<unsigned char>(zhdr >> 8);
+        zh[1] = static_cast<unsigned char>(zhdr & 0xff);
+
+        check = adler[0];
+        for (size_t b = 1; b < nblocks; b++) {
+            size_t blen = (std::min(height, (b + 1) * block_rows) - b * block_rows) * linelen;
+            check = adler32_combine(check, adler[b], static_cast<z_off_t>(blen));
+        }
+    }
+
+    ChunkWriter w;
+    w.ptr = reinterpret_cast<unsigned char*>(dst.buffer);
+    w.left = dst.size;
+    bool ok = w.put(PNG_SIGNATURE, 8);
+
+    unsigned char ihdr[13];
+    uint32_t v = htobe32(static_cast<uint32_t>(rsize.x));
+    memcpy(ihdr, &v, 4);
+    v = htobe32(static_cast<uint32_t>(rsize.y));
+    memcpy(ihdr + 4, &v, 4);
+    ihdr[8] = static_cast<unsigned char>(params.bit_depth);
+    ihdr[9] = static_cast<unsigned char>(params.color_type);
+    ihdr[10] = ihdr[11] = ihdr[12] = 0; // Compression, filter, interlace
+    ok = ok && w.begin("IHDR") && w.put(ihdr, 13) && w.end();
+
+    if (red) {
+        if (!red->plte.empty())
+            ok = ok && w.begin("PLTE") && w.put(red->plte.data(), red->plte.size()) && w.end();
+        if (!red->trns.empty())
+            ok = ok && w.begin("tRNS") && w.put(red->trns.data(), red->trns.size()) && w.end();
+    }
+    // NDV as the transparent color, only valid without alpha
+    else if (params.has_transparency && !(params.color_type & 4)) {
+        uint16_t key = png_key(params);
+        unsigned char tcolor[6];
+        for (int i = 0; i < 6; i += 2) {
+            tcolor[i] = static_cast<unsigned char>(key >> 8);
+            tcolor[i + 1] = static_cast<unsigned char>(key);
+        }
+        ok = ok && w.begin("tRNS") && w.put(tcolor, (params.color_type == 2) ? 6 : 2)
+            && w.end();
+    }
+
+    // One IDAT per block
+    for (size_t b = 0; ok && b < out.size(); b++) {
+        ok = w.begin("IDAT");
+        if (ok && b == 0 && !whole)
+            ok = w.put(zh, 2);
+        ok = ok && w.put(out[b].data(), out[b].size());
+        if (ok && b + 1 == out.size() && !whole)
+            ok = w.put32(static_cast<uint32_t>(check));
+        ok = ok && w.end();
+    }
+    ok = ok && w.begin("IEND") && w.end();
+    if (!ok)
+        return "PNG encode buffer overflow";
+
+    dst.size -= w.left;
+    return nullptr;
+}
+
+NS_END
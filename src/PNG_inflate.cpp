@@ -0,0 +1,269 @@
+/*
+* PNG_inflate.cpp
+* In-tree PNG decoder for the subset of PNG that libicd generates
+*
+* 8 or 16 bit, non-palette, non-interlaced images only
+* All the rows are inflated in one call by the deflate backend, directly from the
+* source buffer if there is a single IDAT, then unfiltered in place and copied out
+*
+* (C)Lucian Plesea 2025
+*/
+
+#include "PNG_codec.h"
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
+NS_ICD_START
+
+#if defined(USE_SSE2)
+// One pixel of up to 8 bytes at a time, sample math in 16 bit lanes
+// bpp is a compile time constant, so the memcpy calls are simple moves
+template<size_t bpp> static inline __m128i load_px(const unsigned char* p) {
+    uint64_t v = 0;
+    memcpy(&v, p, bpp);
+    return _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(&v)),
+        _mm_setzero_si128());
+}
+
+template<size_t bpp> static inline void store_px(unsigned char* p, __m128i v) {
+    uint64_t r;
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(&r), _mm_packus_epi16(v, v));
+    memcpy(p, &r, bpp);
+}
+
+static inline __m128i if_then_else(__m128i c, __m128i t, __m128i e) {
+    return _mm_or_si128(_mm_and_si128(c, t), _mm_andnot_si128(c, e));
+}
+
+static inline __m128i abs_epi16(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+// Sample addition is modulo 256
+static inline __m128i add_mod(__m128i x, __m128i p) {
+    return _mm_and_si128(_mm_add_epi16(x, p), _mm_set1_epi16(0xff));
+}
+#endif
+
+// Unfilter one row in place, prev is the previous unfiltered row or zeros
+// bpp is the number of bytes per complete pixel, 1 to 8
+template<size_t bpp> static bool unfilter(int filter, unsigned char* row,
+    const unsigned char* prev, size_t len)
+{
+    size_t i = 0;
+    switch (filter) {
+    case FILT_NONE:
+        return true;
+
+    case FILT_UP:
+#if defined(USE_SSE2)
+        for (; i + 16 <= len; i += 16) {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), _mm_add_epi8(x, b));
+        }
+#endif
+        for (; i < len; i++)
+            row[i] += prev[i];
+        return true;
+
+    case FILT_SUB:
+#if defined(USE_SSE2)
+    {
+        __m128i a = _mm_setzero_si128();
+        for (; i + bpp <= len; i += bpp) {
+            a = add_mod(load_px<bpp>(row + i), a);
+            store_px<bpp>(row + i, a);
+        }
+    }
+#endif
+        // First pixel has no left neighbor
+        for (i = std::max(i, bpp); i < len; i++)
+            row[i] += row[i - bpp];
+        return true;
+
+    case FILT_AVG:
+#if defined(USE_SSE2)
+    {
+        __m128i a = _mm_setzero_si128();
+        for (; i + bpp <= len; i += bpp) {
+            __m128i b = load_px<bpp>(prev + i);
+            a = add_mod(load_px<bpp>(row + i), _mm_srli_epi16(_mm_add_epi16(a, b), 1));
+            store_px<bpp>(row + i, a);
+        }
+    }
+#endif
+        for (; i < bpp && i < len; i++)
+            row[i] += prev[i] >> 1;
+        for (; i < len; i++)
+            row[i] += (row[i - bpp] + prev[i]) >> 1;
+        return true;
+
+    case FILT_PAETH:
+#if defined(USE_SSE2)
+    {
+        __m128i a = _mm_setzero_si128();
+        __m128i c = _mm_setzero_si128();
+        for (; i + bpp <= len; i += bpp) {
+            __m128i b = load_px<bpp>(prev + i);
+            __m128i pa = _mm_sub_epi16(b, c);
+            __m128i pb = _mm_sub_epi16(a, c);
+            __m128i pc = abs_epi16(_mm_add_epi16(pa, pb));
+            pa = abs_epi16(pa);
+            pb = abs_epi16(pb);
+            __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            // Ties favor a over b over c
+            __m128i nearest = if_then_else(_mm_cmpeq_epi16(smallest, pa), a,
+                if_then_else(_mm_cmpeq_epi16(smallest, pb), b, c));
+            a = add_mod(load_px<bpp>(row + i), nearest);
+            store_px<bpp>(row + i, a);
+            c = b;
+        }
+    }
+#endif
+        for (; i < bpp && i < len; i++)
+            row[i] += prev[i]; // paeth(0, b, 0) is b
+        for (; i < len; i++)
+            row[i] += static_cast<unsigned char>(paeth(row[i - bpp], prev[i], prev[i - bpp]));
+        return true;
+    }
+    return false; // Unknown filter
+}
+
+static bool unfilter(int filter, unsigned char* row, const unsigned char* prev,
+    size_t len, size_t bpp)
+{
+    switch (bpp) {
+    case 1: return unfilter<1>(filter, row, prev, len);
+    case 2: return unfilter<2>(filter, row, prev, len);
+    case 3: return unfilter<3>(filter, row, prev, len);
+    case 4: return unfilter<4>(filter, row, prev, len);
+    case 6: return unfilter<6>(filter, row, prev, len);
+    case 8: return unfilter<8>(filter, row, prev, len);
+    }
+    return false;
+}
+
+// PNG is big endian, swap the bytes of each 16 bit sample
+void png_swap16(unsigned char* dst, const unsigned char* src, size_t len) {
+    size_t i = 0;
+#if defined(NEED_SWAP)
+#if defined(USE_SSE2)
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), v);
+    }
+#endif
+    for (; i + 1 < len; i += 2) {
+        dst[i] = src[i + 1];
+        dst[i + 1] = src[i];
+    }
+#else
+    memcpy(dst, src, len);
+#endif
+}
+
+// Copies the visible part of a decoded row to the canvas, 16 bit samples get swapped
+static void put_row(const png_canvas& canvas, ptrdiff_t y, const unsigned char* row, int depth) {
+    if (y < canvas.y0 || y >= canvas.y1 || canvas.x1 <= canvas.x0)
+        return;
+    unsigned char* out = canvas.at(canvas.x0, y);
+    row += canvas.x0 * canvas.pixel;
+    size_t len = (canvas.x1 - canvas.x0) * canvas.pixel;
+    if (depth == 16)
+        png_swap16(out, row, len);
+    else
+        memcpy(out, row, len);
+}
+
+bool png_fast_decode(codec_params& params, const storage_manager& src, const png_canvas& canvas)
+{
+    auto const& rsize = params.raster.size;
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(src.buffer);
+    const unsigned char* end = p + src.size;
+    if (params.reduction || src.size < 8 + 25 + 12 || memcmp(p, PNG_SIGNATURE, 8))
+        return false;
+    p += 8;
+
+    // VERIFY has already checked all the CRCs, TRUSTED doesn't check
+    bool check = params.integrity == INTEGRITY_DEFAULT;
+    // IHDR is always first
+    if (readBE32(p) != 13 || memcmp(p + 4, "IHDR", 4)
+        || (check && readBE32(p + 21) != png_crc32(0, p + 4, 17)))
+        return false;
+    const unsigned char* ihdr = p + 8;
+    uint32_t width = readBE32(ihdr);
+    uint32_t height = readBE32(ihdr + 4);
+    int depth = ihdr[8], ctype = ihdr[9];
+    static const int bands[] = { 1, 0, 3, 0, 2, 0, 4 };
+    if (width != rsize.x || height != rsize.y || ctype > 6 || bands[ctype] == 0
+        || static_cast<size_t>(bands[ctype]) != rsize.c
+        || ihdr[10] || ihdr[11] || ihdr[12]) // Compression, filter, interlace
+        return false;
+    if (!((depth == 8 && params.raster.dt == ICDT_Byte)
+        || (depth == 16 && (params.raster.dt == ICDT_UInt16 || params.raster.dt == ICDT_Int16))))
+        return false;
+    p += 25;
+
+    // Find the first IDAT, any unknown critical chunk is handled by libpng
+    for (;;) {
+        if (p + 12 > end)
+            return false;
+        uint32_t len = readBE32(p);
+        if (len >> 31 || p + 12 + len > end)
+            return false;
+        if (!memcmp(p + 4, "IDAT", 4))
+            break;
+        if (!(p[4] & 0x20) && memcmp(p + 4, "PLTE", 4))
+            return false;
+        p += 12 + len;
+    }
+
+    size_t bpp = rsize.c * depth / 8;
+    size_t rowbytes = bpp * width;
+
+    // The zlib stream is used in place if there is a single IDAT, otherwise it gets copied
+    std::vector<unsigned char> zbuf;
+    const unsigned char* zdata = p + 8;
+    size_t zlen = 0;
+    for (const unsigned char* c = p; c + 12 <= end && !memcmp(c + 4, "IDAT", 4);) {
+        uint32_t len = readBE32(c);
+        if (len >> 31 || c + 12 + len > end)
+            return false;
+        if (check && readBE32(c + 8 + len) != png_crc32(0, c + 4, len + 4))
+            return false;
+        if (c != p) {
+            if (zdata != zbuf.data())
+                zbuf.assign(zdata, zdata + zlen);
+            zbuf.insert(zbuf.end(), c + 8, c + 8 + len);
+            zdata = zbuf.data();
+        }
+        zlen += len;
+        c += 12 + len;
+    }
+
+    // Inflate all the rows, then unfilter them in place
+    size_t linelen = rowbytes + 1;
+    std::vector<unsigned char> rows(linelen * height);
+    if (!png_inflate(zdata, zlen, rows.data(), rows.size(), params.integrity != INTEGRITY_TRUSTED))
+        return false;
+    const std::vector<unsigned char> zeros(rowbytes);
+    const unsigned char* prev = zeros.data();
+    for (uint32_t y = 0; y < height; y++) {
+        unsigned char* row = &rows[y * linelen + 1];
+        if (!unfilter(row[-1], row, prev, rowbytes, bpp))
+            return false;
+        put_row(canvas, y, row, depth);
+        prev = row;
+    }
+    return true;
+}
+
+NS_END
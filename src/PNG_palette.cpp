@@ -0,0 +1,246 @@
+/*
+* PNG_palette.cpp
+* Palette construction for PNG encoding
+*
+* Tiles with 256 colors or fewer get an exact palette, found with an open
+* addressing hash set. Tiles with more colors can be quantized by median cut
+* The indices are packed to 1, 2, 4 or 8 bits, as small as the palette allows
+*
+* (C)Lucian Plesea 2025
+*/
+
+#include "PNG_codec.h"
+#include <algorithm>
+#include <unordered_map>
+
+NS_ICD_START
+
+// Colors are packed as RGBA, R in the low byte, opaque when there is no alpha
+static inline uint32_t get_color(const unsigned char* p, size_t bands) {
+    return p[0] | (p[1] << 8) | (p[2] << 16)
+        | ((bands == 4) ? (static_cast<uint32_t>(p[3]) << 24) : 0xff000000u);
+}
+
+static inline uint32_t alpha(uint32_t c) {
+    return c >> 24;
+}
+
+// Open addressing hash set of up to 256 colors, with an index for each color
+struct ColorSet {
+    static const size_t SIZE = 1024; // Power of two, keeps the load under 1/4
+    uint32_t keys[SIZE];
+    int16_t values[SIZE]; // -1 for an empty slot
+    size_t count;
+
+    ColorSet() : count(0) {
+        std::fill(values, values + SIZE, static_cast<int16_t>(-1));
+    }
+
+    size_t slot(uint32_t c) const {
+        size_t i = (c * 0x9e3779b1u) >> 22; // Top 10 bits
+        while (values[i] >= 0 && keys[i] != c)
+            i = (i + 1) & (SIZE - 1);
+        return i;
+    }
+
+    // Returns false if the set is full
+    bool insert(uint32_t c) {
+        size_t i = slot(c);
+        if (values[i] >= 0)
+            return true;
+        if (count == 256)
+            return false;
+        keys[i] = c;
+        values[i] = static_cast<int16_t>(count++);
+        return true;
+    }
+};
+
+// Packs one row of indices, MSB first
+static void pack_row(const unsigned char* idx, unsigned char* out, size_t width, int depth) {
+    if (depth == 8) {
+        memcpy(out, idx, width);
+        return;
+    }
+    int per_byte = 8 / depth;
+    for (size_t x = 0; x < width; x += per_byte) {
+        unsigned char v = 0;
+        for (int i = 0; i < per_byte; i++)
+            v |= ((x + i < width) ? idx[x + i] : 0) << (8 - depth * (i + 1));
+        *out++ = v;
+    }
+}
+
+// Fills the PLTE and tRNS contents from the RGBA colors
+// Translucent colors go first, so tRNS is as short as possible
+// Returns the new index of each color
+static std::vector<unsigned char> order_palette(const std::vector<uint32_t>& colors,
+    png_reduced& pal)
+{
+    std::vector<size_t> order(colors.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    std::stable_partition(order.begin(), order.end(),
+        [&](size_t i) { return alpha(colors[i]) != 0xff; });
+
+    std::vector<unsigned char> remap(colors.size());
+    pal.plte.clear();
+    pal.trns.clear();
+    for (size_t i = 0; i < order.size(); i++) {
+        uint32_t c = colors[order[i]];
+        remap[order[i]] = static_cast<unsigned char>(i);
+        pal.plte.push_back(static_cast<unsigned char>(c));
+        pal.plte.push_back(static_cast<unsigned char>(c >> 8));
+        pal.plte.push_back(static_cast<unsigned char>(c >> 16));
+        if (alpha(c) != 0xff)
+            pal.trns.push_back(static_cast<unsigned char>(alpha(c)));
+    }
+    size_t n = colors.size();
+    pal.color_type = 3;
+    pal.depth = (n <= 2) ? 1 : (n <= 4) ? 2 : (n <= 16) ? 4 : 8;
+    return remap;
+}
+
+// Median cut over the distinct colors, weighted by pixel count
+// Returns the palette colors and sets the palette index for every distinct color
+static std::vector<uint32_t> median_cut(std::unordered_map<uint32_t, uint32_t>& hist,
+    size_t ncolors)
+{
+    struct Entry { uint32_t color, count; };
+    std::vector<Entry> entries;
+    entries.reserve(hist.size());
+    for (auto& it : hist)
+        entries.push_back({ it.first, it.second });
+
+    // A box is a range in entries, with its widest channel
+    struct Box { size_t begin, end; uint32_t width; int ch; };
+    auto channel = [](uint32_t c, int ch) { return (c >> (8 * ch)) & 0xff; };
+    auto make_box = [&](size_t begin, size_t end) {
+        Box box = { begin, end, 0, 0 };
+        for (int ch = 0; ch < 4; ch++) {
+            uint32_t lo = 255, hi = 0;
+            for (size_t i = begin; i < end; i++) {
+                lo = std::min(lo, channel(entries[i].color, ch));
+                hi = std::max(hi, channel(entries[i].color, ch));
+            }
+            if (hi > lo && hi - lo > box.width) {
+                box.width = hi - lo;
+                box.ch = ch;
+            }
+        }
+        return box;
+    };
+    std::vector<Box> boxes(1, make_box(0, entries.size()));
+
+    while (boxes.size() < ncolors) {
+        // Split the box with the widest channel range
+        size_t pick = 0;
+        for (size_t b = 1; b < boxes.size(); b++)
+            if (boxes[b].width > boxes[pick].width)
+                pick = b;
+        Box box = boxes[pick];
+        if (box.width == 0)
+            break; // Nothing left to split
+
+        // Cut at the weighted median of that channel
+        auto first = entries.begin() + box.begin, last = entries.begin() + box.end;
+        std::sort(first, last, [&](const Entry& a, const Entry& b) {
+            return channel(a.color, box.ch) < channel(b.color, box.ch);
+        });
+        uint64_t total = 0, half = 0;
+        for (auto it = first; it != last; ++it)
+            total += it->count;
+        size_t cut = box.begin;
+        while (cut < box.end - 1 && (half + entries[cut].count) * 2 <= total)
+            half += entries[cut++].count;
+        if (cut == box.begin)
+            cut++;
+        boxes[pick] = make_box(box.begin, cut);
+        boxes.push_back(make_box(cut, box.end));
+    }
+
+    // Each box becomes the weighted average of its colors
+    std::vector<uint32_t> palette;
+    for (size_t b = 0; b < boxes.size(); b++) {
+        uint64_t sum[4] = {}, total = 0;
+        for (size_t i = boxes[b].begin; i < boxes[b].end; i++) {
+            for (int ch = 0; ch < 4; ch++)
+                sum[ch] += static_cast<uint64_t>(channel(entries[i].color, ch)) * entries[i].count;
+            total += entries[i].count;
+            hist[entries[i].color] = static_cast<uint32_t>(b);
+        }
+        uint32_t c = 0;
+        for (int ch = 0; ch < 4; ch++)
+            c |= static_cast<uint32_t>((sum[ch] + total / 2) / total) << (8 * ch);
+        palette.push_back(c);
+    }
+    return palette;
+}
+
+bool png_palettize(const png_params& params, const storage_manager& src, png_reduced& pal)
+{
+    auto const& rsize = params.raster.size;
+    size_t bands = rsize.c;
+    if (params.raster.dt != ICDT_Byte || (bands != 3 && bands != 4))
+        return false;
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(src.buffer);
+    size_t npixels = rsize.x * rsize.y;
+    if (0 == npixels)
+        return false;
+
+    // RGB pixels matching the NDV key are transparent
+    bool keyed = bands == 3 && params.has_transparency;
+    uint32_t key = png_key(params) * 0x010101u | 0xff000000u;
+    auto color = [&](size_t i) {
+        uint32_t c = get_color(data + i * bands, bands);
+        return (keyed && c == key) ? (c & 0xffffff) : c;
+    };
+
+    // Exact palette, if it fits
+    ColorSet set;
+    bool exact = true;
+    uint32_t last = ~color(0); // Runs of the same color are common
+    for (size_t i = 0; exact && i < npixels; i++) {
+        uint32_t c = color(i);
+        if (c != last)
+            exact = set.insert(c);
+        last = c;
+    }
+
+    std::vector<unsigned char> idx(npixels);
+    if (exact) {
+        std::vector<uint32_t> colors(set.count);
+        for (size_t i = 0; i < ColorSet::SIZE; i++)
+            if (set.values[i] >= 0)
+                colors[set.values[i]] = set.keys[i];
+        auto remap = order_palette(colors, pal);
+        last = ~color(0);
+        unsigned char index = 0;
+        for (size_t i = 0; i < npixels; i++) {
+            uint32_t c = color(i);
+            if (c != last)
+                index = remap[set.values[set.slot(c)]];
+            idx[i] = index;
+            last = c;
+        }
+    }
+    else {
+        if (params.quantize < 2)
+            return false;
+        std::unordered_map<uint32_t, uint32_t> hist;
+        for (size_t i = 0; i < npixels; i++)
+            hist[color(i)]++;
+        auto colors = median_cut(hist, std::min(params.quantize, 256));
+        auto remap = order_palette(colors, pal);
+        for (size_t i = 0; i < npixels; i++)
+            idx[i] = remap[hist[color(i)]];
+    }
+
+    size_t rowbytes = (rsize.x * pal.depth + 7) / 8;
+    pal.rows.resize(rowbytes * rsize.y);
+    for (size_t y = 0; y < rsize.y; y++)
+        pack_row(&idx[y * rsize.x], &pal.rows[y * rowbytes], rsize.x, pal.depth);
+    return true;
+}
+
+NS_END
@@ -0,0 +1,149 @@
+/*
+* PNG_reduce.cpp
+* Band and bit depth reduction for PNG encoding
+*
+* Finds the smallest PNG color type that holds the input exactly
+* Gray instead of RGB, no alpha when it is always opaque, a tRNS color
+* key instead of an alpha band when alpha is either 0 or max and the
+* transparent pixels have a single color, not used by any opaque pixel
+* 8 bit gray values that are multiples of 17, 85 or 255 are written at 4, 2 or 1 bit
+*
+* (C)Lucian Plesea 2025
+*/
+
+#include "PNG_codec.h"
+#include <algorithm>
+
+NS_ICD_START
+
+// Summary of the input samples
+struct Survey {
+    bool color;       // R, G and B differ somewhere
+    bool translucent; // Some alpha between 0 and max
+    bool transparent; // Some alpha is 0
+    bool keyed;       // Transparency can be a color key
+    size_t key;       // Index of the first transparent pixel
+};
+
+// Color of pixel i equals color of pixel j
+template<typename T> static inline bool same_color(const T* p, size_t bands, size_t i, size_t j) {
+    for (size_t b = 0; b < bands - 1; b++)
+        if (p[i * bands + b] != p[j * bands + b])
+            return false;
+    return true;
+}
+
+template<typename T> static Survey survey(const T* p, size_t npixels, size_t bands, T maxv) {
+    Survey s = {};
+    bool alpha = !(bands & 1);
+    // Accumulate without branches, so it vectorizes
+    T color = 0;
+    uint32_t translucent = 0, transparent = 0;
+    for (size_t i = 0; i < npixels; i++) {
+        const T* px = p + i * bands;
+        if (bands > 2)
+            color |= static_cast<T>((px[0] ^ px[1]) | (px[0] ^ px[2]));
+        if (alpha) {
+            T a = px[bands - 1];
+            translucent |= (a != 0) & (a != maxv);
+            transparent |= (a == 0);
+        }
+    }
+    s.color = color != 0;
+    s.translucent = translucent != 0;
+    s.transparent = transparent != 0;
+    if (!s.transparent || s.translucent)
+        return s;
+
+    // Binary alpha, check that a color key works
+    s.key = 0;
+    while (p[s.key * bands + bands - 1] != 0)
+        s.key++;
+    s.keyed = true;
+    for (size_t i = s.key + 1; s.keyed && i < npixels; i++)
+        s.keyed = (p[i * bands + bands - 1] == 0) == same_color(p, bands, i, s.key);
+    return s;
+}
+
+// Bits needed for 8 bit gray, values have to be multiples of 255 / (2^bits - 1)
+static int gray_depth(const unsigned char* p, size_t npixels, size_t bands) {
+    int depth = 1;
+    for (size_t i = 0; depth < 8 && i < npixels; i++) {
+        int v = p[i * bands];
+        while (v % (255 / ((1 << depth) - 1)))
+            depth *= 2;
+    }
+    return depth;
+}
+
+template<typename T> static bool reduce(const png_params& params, const T* p, png_reduced& red) {
+    auto const& rsize = params.raster.size;
+    size_t bands = rsize.c;
+    size_t npixels = rsize.x * rsize.y;
+    T maxv = static_cast<T>(~static_cast<T>(0));
+    Survey s = survey(p, npixels, bands, maxv);
+
+    bool alpha = !(bands & 1);
+    bool gray = bands < 3 || !s.color;
+    // Alpha band is needed if there is any translucency, or transparency without a key
+    bool keep_alpha = alpha && (s.translucent || (s.transparent && !s.keyed));
+    bool key = alpha && !keep_alpha && s.transparent;
+    size_t obands = (gray ? 1 : 3) + (keep_alpha ? 1 : 0);
+    int depth = params.bit_depth;
+    // Low bit depth gray only without a color key
+    if (sizeof(T) == 1 && obands == 1 && !key && !params.has_transparency)
+        depth = gray_depth(reinterpret_cast<const unsigned char*>(p), npixels, bands);
+    if (obands == bands && depth == params.bit_depth)
+        return false; // No gain
+
+    red.color_type = (gray ? 0 : 2) | (keep_alpha ? 4 : 0);
+    red.depth = depth;
+    red.plte.clear();
+    red.trns.clear();
+    // The color key, in PNG order
+    if (key || (!alpha && params.has_transparency)) {
+        for (size_t b = 0; b < (gray ? 1u : 3u); b++) {
+            T v = key ? p[s.key * bands + b] : static_cast<T>(png_key(params));
+            red.trns.push_back(static_cast<unsigned char>(sizeof(T) == 1 ? 0 : v >> 8));
+            red.trns.push_back(static_cast<unsigned char>(v));
+        }
+    }
+
+    // Copy the kept bands
+    size_t rowbytes = (rsize.x * obands * depth + 7) / 8;
+    red.rows.assign(rowbytes * rsize.y, 0);
+    if (depth < 8) { // Single band
+        int scale = 255 / ((1 << depth) - 1);
+        for (size_t y = 0; y < rsize.y; y++) {
+            unsigned char* out = &red.rows[y * rowbytes];
+            for (size_t x = 0; x < rsize.x; x++) {
+                size_t bit = x * depth;
+                out[bit / 8] |= (p[(y * rsize.x + x) * bands] / scale) << (8 - depth - bit % 8);
+            }
+        }
+        return true;
+    }
+    T* out = reinterpret_cast<T*>(red.rows.data());
+    size_t ob = gray ? 1 : 3;
+    for (size_t i = 0; i < npixels; i++) {
+        const T* px = p + i * bands;
+        for (size_t b = 0; b < ob; b++)
+            *out++ = px[b];
+        if (keep_alpha)
+            *out++ = px[bands - 1];
+    }
+    return true;
+}
+
+bool png_reduce(const png_params& params, const storage_manager& src, png_reduced& red)
+{
+    if (0 == params.raster.size.x * params.raster.size.y)
+        return false;
+    if (params.bit_depth == 8)
+        return reduce(params, reinterpret_cast<const uint8_t*>(src.buffer), red);
+    if (params.bit_depth == 16)
+        return reduce(params, reinterpret_cast<const uint16_t*>(src.buffer), red);
+    return false;
+}
+
+NS_END
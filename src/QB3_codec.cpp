@@ -77,6 +77,8 @@ const char* stride_decode_qb3(codec_params& params, storage_manager& src, void*
 {
     if (src.size < 100)
         return ERR_SMALL;
+    if (params.reduction)
+        return "Reduced size decode is not supported for QB3";
     // Start reading the QB3 file
     size_t size[3]; // X, Y, C
     decsp p = qb3_read_start(src.buffer, src.size, size);
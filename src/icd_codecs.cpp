@@ -67,6 +67,12 @@ const char* stride_decode(codec_params& params, storage_manager& src, void* buff
     uint32_t sig = 0;
     memcpy(&sig, src.buffer, sizeof(sig));
     params.raster.format = IMG_UNKNOWN;
+    if (sig != PNG_SIG && (params.x_offset || params.y_offset || params.canvas_x || params.canvas_y))
+        return "Canvas placement is only supported for PNG";
+    if (params.reduction < 0 || params.reduction > 3)
+        return "Invalid reduction";
+    if (sig != PNG_SIG && sig != JPEG_SIG && sig != JPEG1_SIG && params.reduction)
+        return "Reduced size decode is only supported for JPEG and PNG";
     switch (sig)
     {
     case JPEG_SIG:
@@ -138,6 +138,33 @@ LIBICD_EXPORT size_t getTypeSize(ICDDataType dt, size_t num = 1);
 // Return a data type by name
 LIBICD_EXPORT ICDDataType getDT(const char* name);
 
+// Speed versus accuracy trade-off, for codecs that have one
+// For JPEG:
+//  EXACT uses the floating point DCT and the default smooth upsampling
+//  BALANCED uses the accurate integer DCT, which has SIMD code in libjpeg-turbo
+//  FAST uses the fast integer DCT, merged upsampling and no block smoothing
+enum SPEED_T { SPEED_EXACT = 0, SPEED_BALANCED, SPEED_FAST };
+
+// Decoder checksum handling, for codecs that have checksums
+// For PNG:
+//  DEFAULT lets libpng check the chunk CRCs, in-tree decoding checks the IDAT CRCs
+//  VERIFY checks every chunk CRC before decoding, using hardware CRC-32 when available
+//  TRUSTED skips the CRC and the zlib Adler-32 checks, for data from a known source
+enum INTEGRITY_T { INTEGRITY_DEFAULT = 0, INTEGRITY_VERIFY, INTEGRITY_TRUSTED };
+
+// PNG encoding row filter
+//  ADAPTIVE picks the best filter for each row, the libpng default
+//  AUTO picks a single filter from a sample of rows
+enum PNG_FILTER_T { PNGF_ADAPTIVE = 0, PNGF_NONE, PNGF_SUB, PNGF_UP, PNGF_AUTO };
+
+// PNG encoding zlib strategy
+//  DEFAULT is the libpng default, same as FILTERED for filtered images
+//  RLE is fast and works well for large uniform areas
+//  HUFFMAN skips the match search, for noisy data
+//  AUTO picks one from a sample of filtered rows
+//  Ignored by a single thread encode with libdeflate, which picks its own
+enum PNG_STRATEGY_T { PNGS_DEFAULT = 0, PNGS_FILTERED, PNGS_RLE, PNGS_HUFFMAN, PNGS_AUTO };
+
 struct sz5 {
     size_t x, y, z, c, l;
     const bool operator==(const sz5& other) {
@@ -176,22 +203,55 @@ struct codec_params {
     LIBICD_EXPORT codec_params(const Raster& r) :
         raster(r),
         line_stride(0),
+        reduction(0),
+        profile(SPEED_EXACT),
+        integrity(INTEGRITY_DEFAULT),
+        x_offset(0),
+        y_offset(0),
+        canvas_x(0),
+        canvas_y(0),
+        threads(1),
         error_message(""),
         modified(false)
     { reset(); }
 
-    // Call if modifying the raster
+    // Call if modifying the raster or the reduction
     LIBICD_EXPORT void reset() {
-        line_stride = getTypeSize(raster.dt, raster.size.x * raster.size.c);
+        line_stride = getTypeSize(raster.dt, reduced(raster.size.x) * raster.size.c);
     }
 
     LIBICD_EXPORT size_t get_buffer_size() const {
-        return getTypeSize(raster.dt, raster.size.x * raster.size.y * raster.size.c);
+        return getTypeSize(raster.dt,
+            reduced(raster.size.x) * reduced(raster.size.y) * raster.size.c);
+    }
+
+    // Decoded size of a raster dimension, rounded up, 0 if the reduction is not 0 to 3
+    LIBICD_EXPORT size_t reduced(size_t v) const {
+        if (reduction < 0 || reduction > 3)
+            return 0;
+        return (v + (static_cast<size_t>(1) << reduction) - 1) >> reduction;
     }
 
     Raster raster;
     // Line size in bytes for decoding only
     size_t line_stride;
+    // Decode at 1 / 2^reduction of the raster size, JPEG and PNG only, other codecs fail
+    // For JPEG, 3 uses only the DC coefficients
+    // For PNG, only the Adam7 passes needed are read from interlaced images
+    int reduction;
+    // Speed versus accuracy, for decoding and encoding
+    SPEED_T profile;
+    // Checksum verification, for decoding
+    INTEGRITY_T integrity;
+    // Decode into a larger canvas, for PNG only, in decoded pixels
+    // The tile goes at x_offset, y_offset from buffer, with line_stride being the canvas line size
+    // If canvas_x and canvas_y are set, the offsets can be negative and only the part of
+    // the tile inside a canvas of that size is written
+    ptrdiff_t x_offset, y_offset;
+    size_t canvas_x, canvas_y;
+    // Worker threads, for PNG encoding and LERC1 encoding and decoding
+    // For PNG, above 1 uses the in-tree parallel encoder
+    int threads;
     // A buffer for codec error message
     char error_message[1024];
     // Set if special data handling took place during decoding (zero mask on JPEG)
@@ -200,8 +260,11 @@ struct codec_params {
 
 // Specialized by format, for encode
 struct jpeg_params : codec_params {
-    LIBICD_EXPORT jpeg_params(const Raster& r) : codec_params(r), quality(75) {}
+    LIBICD_EXPORT jpeg_params(const Raster& r) : codec_params(r), quality(75), budget(0) {}
     int quality;
+    // If not zero, encode at the highest quality up to the one above that fits in
+    // this many bytes. The quality used is returned in quality
+    size_t budget;
 };
 
 struct png_params : codec_params {
@@ -212,9 +275,26 @@ struct png_params : codec_params {
     // 0 to 9
     int compression_level;
 
-    // If true, NDV is the transparent color
+    // If true and there is no alpha band, NDV is the transparent color, as a tRNS chunk
+    // NDV comes from raster.ndv if raster.has_ndv is set, otherwise it is 0
     int has_transparency;
-    // TODO: Have a way to pass the transparent color when has_transparency is true
+
+    // Encoding speed and size trade-off
+    PNG_FILTER_T filter;
+    PNG_STRATEGY_T strategy;
+
+    // 8 bit RGB and RGBA only, encode as palette if there are 256 colors or fewer
+    int palette;
+    // If set, tiles with more colors are quantized to this many colors, lossy
+    int quantize;
+
+    // Write the smallest equivalent color type and bit depth, such as gray for RGB
+    // Decode with the original raster.size.c to get the input layout back
+    int reduce;
+
+    // Adam7 interlaced, allows fast decoding at reduced resolution
+    // Uses a single thread
+    int interlace;
 };
 
 struct lerc_params : codec_params {
@@ -247,6 +327,20 @@ LIBICD_EXPORT const char* stride_decode(codec_params& params, storage_manager& s
 LIBICD_EXPORT const char* jpeg_peek(const storage_manager& src, Raster& raster);
 LIBICD_EXPORT const char* jpeg_stride_decode(codec_params& params, storage_manager& src, void* buffer);
 LIBICD_EXPORT const char* jpeg_encode(jpeg_params& params, storage_manager& src, storage_manager& dst);
+// Re-compress an existing JPEG at params.quality, without decoding it to pixels
+// Works on the DCT coefficients, the Zen mask is copied unchanged
+// The result is never of higher quality than the input
+LIBICD_EXPORT const char* jpeg_requantize(jpeg_params& params, storage_manager& src, storage_manager& dst);
+
+// The 12 bit JPEG codec takes its working memory from an arena, not from the heap
+// Selects a caller owned arena for the following 12 bit JPEG calls on this thread
+// The arena start is rounded up to 16 bytes, allow for it when sizing the arena
+// nullptr selects the default, a thread local slab kept between calls and grown as needed
+// The slab is freed when the thread exits
+// Requests that don't fit in the arena are passed to the heap
+LIBICD_EXPORT void set_arena_jpeg12(const storage_manager* arena);
+// Peak working memory of the last 12 bit JPEG call on this thread, in bytes
+LIBICD_EXPORT size_t peak_memory_jpeg12();
 
 // In PNG_codec.cpp
 // raster defines the expected tile
@@ -258,14 +352,35 @@ LIBICD_EXPORT const char* png_peek(const storage_manager& src, Raster& raster);
 LIBICD_EXPORT const char* png_stride_decode(codec_params& params, storage_manager& src, void* buffer);
 LIBICD_EXPORT const char* png_encode(png_params& params, storage_manager& src, storage_manager& dst);
 
+// One PNG chunk, offset is the start of the chunk data in the PNG
+struct png_chunk {
+    char type[4];
+    uint32_t length;
+    size_t offset;
+};
+
+// Walks the PNG chunks up to IEND, without allocating memory
+// Fills up to count entries of index, which can be null, and sets count to the number of chunks
+// If verify is set, the chunk CRCs are checked
+LIBICD_EXPORT const char* png_chunks(const storage_manager& src, png_chunk* index, size_t& count,
+    bool verify = false);
+
+// In PNG_backend.cpp
+// Name of the deflate library used by the in-tree PNG codec, picked at build time
+LIBICD_EXPORT const char* png_backend();
+
 // In LERC_codec.cpp
-// LERC1 is the only supported version, reads and writes a single band
-// Internally it gets converted to float, it can be read back as any other type
+// LERC1 is the only supported version. Multiple bands are stored as one LERC1 per band,
+// one after the other, the raster buffers are pixel interleaved
+// Values are quantized as float, it can be read back as any other type
 
 // lerc_peek teturns data type as float by default, override params.raster.dt if needed
 LIBICD_EXPORT const char* lerc_peek(const storage_manager& src, Raster& raster);
 // Remember to set the params.raster.dt to the desired output type
 LIBICD_EXPORT const char* lerc_stride_decode(codec_params& params, storage_manager& src, void* buffer);
+// The output size is exact and known before writing, nothing is written if dst is too small
+// If dst.buffer is null or too small, dst.size is set to the size needed
+// A null dst.buffer is not an error, it sizes the output without encoding it
 LIBICD_EXPORT const char* lerc_encode(lerc_params& params, storage_manager& src, storage_manager& dst);
 
 // In QB3_codec.cpp
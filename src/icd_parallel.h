@@ -0,0 +1,35 @@
+/*
+* icd_parallel.h
+*
+* Internal threading helper, shared by the codecs that encode or decode in parallel
+*
+* (C) Lucian Plesea 2025
+*/
+
+#if !defined(ICD_PARALLEL_H)
+#define ICD_PARALLEL_H
+
+#include "icd_codecs.h"
+#include <vector>
+#include <atomic>
+#include <thread>
+
+NS_ICD_START
+
+// Runs fn(i) for i in [0, n), on up to nthreads threads, including the calling one
+template<typename F> inline void parallel_for(size_t n, int nthreads, F fn) {
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < n; i = next++)
+            fn(i);
+    };
+    std::vector<std::thread> pool;
+    for (int t = 1; t < nthreads && static_cast<size_t>(t) < n; t++)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& t : pool)
+        t.join();
+}
+
+NS_END
+#endif
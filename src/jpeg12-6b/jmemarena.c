@@ -0,0 +1,283 @@
+/*
+ * jmemarena.c
+ *
+ * Based on jmemnobs.c, Copyright (C) 1992-1996, Thomas G. Lane.
+ * This file is part of the Independent JPEG Group's software.
+ * For conditions of distribution and use, see the accompanying README file.
+ *
+ * This file provides an arena implementation of the system-dependent
+ * portion of the JPEG memory manager.  All the memory requested between
+ * the creation of the first JPEG object and the destruction of the last
+ * one on a thread is carved out of a single memory block.
+ * The block is either supplied by the caller with jpeg_mem_set_arena, or
+ * it is a thread local slab which is kept between uses and grown to the
+ * peak usage, so steady state operation does no heap allocation.
+ * Requests which do not fit in the block are passed to malloc().
+ * The slab is freed when its thread exits.
+ * No backing-store files are used.
+ */
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+#define JPEG_INTERNALS
+#include "jinclude.h"
+#include "jpeglib.h"
+#include "jmemsys.h"		/* import the system-dependent declarations */
+
+#ifndef HAVE_STDLIB_H		/* <stdlib.h> should declare malloc(),free() */
+extern void * malloc JPP((size_t size));
+extern void free JPP((void *ptr));
+#endif
+
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+/* Allocation granularity, keeps every object aligned for any type */
+#define ARENA_ALIGN 16
+#define ARENA_ROUND(sz) (((sz) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+typedef struct {
+  char * user_base;		/* Caller supplied arena, if any */
+  size_t user_size;
+  char * slab;			/* Thread local slab, owned */
+  size_t slab_size;
+  char * base;			/* Block in use by the current session */
+  size_t size;
+  size_t used;			/* Bytes used from the block */
+  size_t overflow;		/* Bytes obtained from malloc */
+  size_t peak;			/* Peak of used + overflow */
+  int objects;			/* Live JPEG objects on this thread */
+} arena_state;
+
+static THREAD_LOCAL arena_state arena;
+
+
+/*
+ * The slab is also registered with a thread exit destructor, which frees
+ * it when the thread ends.  Thread local variables can't do this in C.
+ */
+
+#if defined(_WIN32)
+
+static DWORD slab_key = FLS_OUT_OF_INDEXES;
+static INIT_ONCE slab_once = INIT_ONCE_STATIC_INIT;
+
+static VOID WINAPI
+slab_release (PVOID slab)
+{
+  free(slab);
+}
+
+static BOOL CALLBACK
+slab_key_init (PINIT_ONCE once, PVOID param, PVOID * context)
+{
+  slab_key = FlsAlloc(slab_release);
+  return TRUE;
+}
+
+LOCAL(void)
+slab_register (void * slab)
+{
+  InitOnceExecuteOnce(&slab_once, slab_key_init, NULL, NULL);
+  if (slab_key != FLS_OUT_OF_INDEXES)
+    FlsSetValue(slab_key, slab);
+}
+
+#else
+
+static pthread_key_t slab_key;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static int slab_key_valid = 0;
+
+static void
+slab_release (void * slab)
+{
+  free(slab);
+}
+
+static void
+slab_key_init (void)
+{
+  slab_key_valid = (0 == pthread_key_create(&slab_key, slab_release));
+}
+
+LOCAL(void)
+slab_register (void * slab)
+{
+  pthread_once(&slab_once, slab_key_init);
+  if (slab_key_valid)
+    pthread_setspecific(slab_key, slab);
+}
+
+#endif
+
+
+/*
+ * Select the memory the next session on this thread draws from.
+ * Passing NULL returns to the thread local slab.  Takes effect when
+ * no JPEG object is alive on the thread.
+ * The start of the buffer is rounded up to ARENA_ALIGN.
+ */
+
+GLOBAL(void)
+jpeg_mem_set_arena (void * buffer, size_t size)
+{
+  size_t skip = (ARENA_ALIGN - ((size_t) buffer & (ARENA_ALIGN - 1))) &
+		(ARENA_ALIGN - 1);
+  if (buffer == NULL)
+    size = skip = 0;
+  else if (skip > size)
+    skip = size;		/* Too small, everything goes to malloc */
+  arena.user_base = buffer ? (char *) buffer + skip : NULL;
+  arena.user_size = size - skip;
+}
+
+/* Peak memory used by the last session on this thread, in bytes */
+
+GLOBAL(size_t)
+jpeg_mem_peak (void)
+{
+  return arena.peak;
+}
+
+
+LOCAL(void *)
+arena_get (size_t sizeofobject)
+{
+  size_t sz = ARENA_ROUND(sizeofobject);
+  void * p;
+  if (arena.base != NULL && sz <= arena.size - arena.used) {
+    p = arena.base + arena.used;
+    arena.used += sz;
+  } else {
+    p = malloc(sz);
+    if (p == NULL)
+      return NULL;
+    arena.overflow += sz;
+  }
+  if (arena.used + arena.overflow > arena.peak)
+    arena.peak = arena.used + arena.overflow;
+  return p;
+}
+
+LOCAL(void)
+arena_free (void * object, size_t sizeofobject)
+{
+  size_t sz = ARENA_ROUND(sizeofobject);
+  char * p = (char *) object;
+  if (arena.base != NULL && p >= arena.base && p < arena.base + arena.size) {
+    /* Only the last object can be returned to the block */
+    if (p + sz == arena.base + arena.used)
+      arena.used -= sz;
+  } else {
+    free(object);
+    arena.overflow -= sz;
+  }
+}
+
+
+GLOBAL(void *)
+jpeg_get_small (j_common_ptr cinfo, size_t sizeofobject)
+{
+  return arena_get(sizeofobject);
+}
+
+GLOBAL(void)
+jpeg_free_small (j_common_ptr cinfo, void * object, size_t sizeofobject)
+{
+  arena_free(object, sizeofobject);
+}
+
+
+/*
+ * "Large" objects are treated the same as "small" ones.
+ */
+
+GLOBAL(void FAR *)
+jpeg_get_large (j_common_ptr cinfo, size_t sizeofobject)
+{
+  return (void FAR *) arena_get(sizeofobject);
+}
+
+GLOBAL(void)
+jpeg_free_large (j_common_ptr cinfo, void FAR * object, size_t sizeofobject)
+{
+  arena_free((void *) object, sizeofobject);
+}
+
+
+/*
+ * This routine computes the total memory space available for allocation.
+ * Requests that don't fit in the arena go to malloc, so there is no limit.
+ */
+
+GLOBAL(long)
+jpeg_mem_available (j_common_ptr cinfo, long min_bytes_needed,
+		    long max_bytes_needed, long already_allocated)
+{
+  return max_bytes_needed;
+}
+
+
+/*
+ * Backing store (temporary file) management.
+ * Since jpeg_mem_available always promised the moon,
+ * this should never be called and we can just error out.
+ */
+
+GLOBAL(void)
+jpeg_open_backing_store (j_common_ptr cinfo, backing_store_ptr info,
+			 long total_bytes_needed)
+{
+  ERREXIT(cinfo, JERR_NO_BACKING_STORE);
+}
+
+
+/*
+ * A session starts when the first JPEG object on the thread is created
+ * and ends when the last one is destroyed.  At the end of a session the
+ * slab is grown to the peak usage, if needed.
+ */
+
+GLOBAL(long)
+jpeg_mem_init (j_common_ptr cinfo)
+{
+  if (arena.objects++ == 0) {
+    if (arena.user_base != NULL) {
+      arena.base = arena.user_base;
+      arena.size = arena.user_size;
+    } else {
+      arena.base = arena.slab;
+      arena.size = arena.slab_size;
+    }
+    arena.used = 0;
+    arena.overflow = 0;
+    arena.peak = 0;
+  }
+  return 0;			/* just set max_memory_to_use to 0 */
+}
+
+GLOBAL(void)
+jpeg_mem_term (j_common_ptr cinfo)
+{
+  if (--arena.objects > 0)
+    return;
+
+  arena.used = 0;
+  if (arena.base == arena.slab && arena.peak > arena.slab_size) {
+    free(arena.slab);
+    arena.slab = (char *) malloc(arena.peak);
+    arena.slab_size = arena.slab ? arena.peak : 0;
+    slab_register(arena.slab);
+  }
+  arena.base = NULL;
+  arena.size = 0;
+}
@@ -41,6 +41,8 @@
 #define jpeg_open_backing_store	jpeg_open_backing_store_12
 #define jpeg_mem_init		jpeg_mem_init_12
 #define jpeg_mem_term		jpeg_mem_term_12
+#define jpeg_mem_set_arena	jpeg_mem_set_arena_12
+#define jpeg_mem_peak		jpeg_mem_peak_12
 #endif /* NEED_SHORT_EXTERNAL_NAMES */
 
 
@@ -207,3 +209,14 @@ EXTERN(void) jpeg_open_backing_store JPP((j_common_ptr cinfo,
 
 EXTERN(long) jpeg_mem_init JPP((j_common_ptr cinfo));
 EXTERN(void) jpeg_mem_term JPP((j_common_ptr cinfo));
+
+
+/*
+ * Extensions provided by the arena memory manager, jmemarena.c.
+ * jpeg_mem_set_arena selects the memory used by the following JPEG objects
+ * on the calling thread, NULL selects a thread local slab.
+ * jpeg_mem_peak returns the peak memory used by the last objects, in bytes.
+ */
+
+EXTERN(void) jpeg_mem_set_arena JPP((void * buffer, size_t size));
+EXTERN(size_t) jpeg_mem_peak JPP((void));
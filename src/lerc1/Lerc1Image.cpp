@@ -22,15 +22,36 @@ Contributors:  Thomas Maurer
 */
 
 #include "Lerc1Image.h"
+#include "../icd_parallel.h"
 #include <cstdint>
 #include <cmath>
 #include <cfloat>
 #include <climits>
 #include <string>
 #include <algorithm>
+#include <type_traits>
+#include <atomic>
+
+// SSE2 is always there on x86-64
+#if defined(__SSE2__) || defined(_M_X64)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
+// Fully unrolled loops, for the bit unpack kernels
+#if defined(__clang__)
+#define UNROLL _Pragma("unroll")
+#elif defined(__GNUC__)
+#define UNROLL _Pragma("GCC unroll 32")
+#else
+#define UNROLL
+#endif
 
 NAMESPACE_LERC1_START
 
+// Shared with the other libicd codecs
+using ICD::parallel_for;
+
 // max quantized value, 28 bits
 // It is wasting a few bits, because a float has only 24bits of precision
 static const double MAXQ = 0x1000000;
@@ -218,6 +239,63 @@ static int nBits(unsigned int v)
     return 1 + r + t + int((0xffffaa50ul >> v) & 0x3);
 }
 
+// Unpacks 32 values of NB bits from NB words, the bit stuffing of the
+// accumulator in writeZTile. Values are MSB first in little endian words
+template <int NB> static void unpack32(const Byte *in, unsigned int *out)
+{
+    uint32_t w[NB + 1];
+    memcpy(w, in, NB * sizeof(uint32_t));
+    w[NB] = 0;  // Not used, keeps the compiler happy
+    UNROLL
+    for (int i = 0; i < 32; i++)
+    {
+        const int j = (i * NB) >> 5, s = (i * NB) & 31;
+        if (s + NB <= 32)
+            out[i] = (w[j] << s) >> (32 - NB);
+        else
+            out[i] =
+                ((w[j] << s) >> (32 - NB)) | (w[j + 1] >> (64 - s - NB));
+    }
+}
+
+typedef void (*Unpacker)(const Byte *, unsigned int *);
+#define U(N) unpack32<N>
+static const Unpacker unpackers[32] = {
+    nullptr, U(1),  U(2),  U(3),  U(4),  U(5),  U(6),  U(7),
+    U(8),    U(9),  U(10), U(11), U(12), U(13), U(14), U(15),
+    U(16),   U(17), U(18), U(19), U(20), U(21), U(22), U(23),
+    U(24),   U(25), U(26), U(27), U(28), U(29), U(30), U(31)};
+#undef U
+
+// Packs 32 values of NB bits into NB words, same as the accumulator in
+// writeZTile
+template <int NB> static void pack32(const unsigned int *in, Byte *out)
+{
+    uint32_t w[NB + 1] = {};
+    UNROLL
+    for (int i = 0; i < 32; i++)
+    {
+        const int j = (i * NB) >> 5, s = (i * NB) & 31;
+        if (s + NB <= 32)
+            w[j] |= in[i] << (32 - s - NB);
+        else
+        {
+            w[j] |= in[i] >> (s + NB - 32);
+            w[j + 1] |= in[i] << (64 - s - NB);
+        }
+    }
+    memcpy(out, w, NB * sizeof(uint32_t));
+}
+
+typedef void (*Packer)(const unsigned int *, Byte *);
+#define P(N) pack32<N>
+static const Packer packers[32] = {
+    nullptr, P(1),  P(2),  P(3),  P(4),  P(5),  P(6),  P(7),
+    P(8),    P(9),  P(10), P(11), P(12), P(13), P(14), P(15),
+    P(16),   P(17), P(18), P(19), P(20), P(21), P(22), P(23),
+    P(24),   P(25), P(26), P(27), P(28), P(29), P(30), P(31)};
+#undef P
+
 static bool blockread(Byte **ppByte, size_t &size, std::vector<unsigned int> &d)
 {
     if (!ppByte || !size)
@@ -246,15 +324,28 @@ static bool blockread(Byte **ppByte, size_t &size, std::vector<unsigned int> &d)
     }
 
     d.resize(numElements);
-    unsigned int numBytes = (numElements * numBits + 7) / 8;
-    if (size < numBytes)
+    size_t bytesNeeded = (static_cast<size_t>(numElements) * numBits + 7) / 8;
+    if (size < bytesNeeded)
         return false;
-    size -= numBytes;
+    size -= bytesNeeded;
+    auto numBytes = static_cast<unsigned int>(bytesNeeded);
+
+    // Whole groups of 32 values use exactly numBits words, no partial word
+    auto unpack = unpackers[numBits];
+    unsigned int *out = d.data();
+    for (unsigned int n = numElements / 32; n; n--, out += 32)
+    {
+        unpack(*ppByte, out);
+        *ppByte += numBits * 4;
+        numBytes -= numBits * 4;
+    }
 
+    // The rest, the last word may be partial
     int bits = 0;  // Available in accumulator, at the high end
     unsigned int acc = 0;
-    for (unsigned int &val : d)
+    for (auto end = d.data() + numElements; out < end; out++)
     {
+        unsigned int &val = *out;
         if (bits >= numBits)
         {  // Enough bits in accumulator
             val = acc >> (32 - numBits);
@@ -302,75 +393,96 @@ unsigned int Lerc1Image::computeNumBytesNeededToWriteVoidImage()
     return sz;  // 67
 }
 
+template <typename T>
 unsigned int
-Lerc1Image::computeNumBytesNeededToWrite(double maxZError, bool onlyZPart,
-                                         InfoFromComputeNumBytes *info) const
+Lerc1Image::computeNumBytesNeededToWrite(const T *data, double maxZError,
+                                         InfoFromComputeNumBytes &info,
+                                         int threads, int pixel_stride) const
 {
+    info.numBytes = 0;
+    if (getSize() == 0 || !data || pixel_stride < 1)
+        return 0;
     unsigned int sz =
         (unsigned int)(sCntZImage.size() + 4 * sizeof(int) + sizeof(double));
-    if (!onlyZPart)
-    {
-        auto m = mask.IsValid(0);
-        info->numTilesVertCnt = 0;
-        info->numTilesHoriCnt = 0;
-        info->maxCntInImg = m;
-        info->numBytesCnt = 0;
-        for (int i = 0; i < getSize(); i++)
-            if (m != mask.IsValid(i))
-            {
-                info->numBytesCnt = mask.RLEsize();
-                info->maxCntInImg = 1;
-                break;
-            }
-        sz += 3 * sizeof(int) + sizeof(float) + info->numBytesCnt;
-    }
+
+    // cnt part
+    auto m = mask.IsValid(0);
+    info.numTilesVertCnt = 0;
+    info.numTilesHoriCnt = 0;
+    info.maxCntInImg = m;
+    info.numBytesCnt = 0;
+    for (int i = 0; !allValid && i < getSize(); i++)
+        if (m != mask.IsValid(i))
+        {
+            info.numBytesCnt = mask.RLEsize();
+            info.maxCntInImg = 1;
+            break;
+        }
+    sz += 3 * sizeof(int) + sizeof(float) + info.numBytesCnt;
 
     // z part
     int numTilesVert, numTilesHori, numBytesOpt;
     float maxValInImg;
-    if (!findTiling(maxZError, numTilesVert, numTilesHori, numBytesOpt,
-                    maxValInImg))
+    if (!findTiling(data, pixel_stride, maxZError, numTilesVert, numTilesHori,
+                    numBytesOpt, maxValInImg, info.zStats, threads))
         return 0;
 
-    info->maxZError = maxZError;
-    info->numTilesVertZ = numTilesVert;
-    info->numTilesHoriZ = numTilesHori;
-    info->numBytesZ = numBytesOpt;
-    info->maxZInImg = maxValInImg;
+    info.maxZError = maxZError;
+    info.numTilesVertZ = numTilesVert;
+    info.numTilesHoriZ = numTilesHori;
+    info.numBytesZ = numBytesOpt;
+    info.maxZInImg = maxValInImg;
 
     sz += 3 * sizeof(int) + sizeof(float) + numBytesOpt;
+    info.numBytes = sz;
     return sz;
 }
 
 // if you change the file format, don't forget to update not only write and
 // read functions, and the file version number, but also the computeNumBytes...
 // and numBytes... functions
-bool Lerc1Image::write(Byte **ppByte, double maxZError) const
+bool Lerc1Image::write(Byte **ppByte, double maxZError, int threads) const
+{
+    return write(ppByte, values.data(), maxZError, threads, 1);
+}
+
+template <typename T>
+bool Lerc1Image::write(Byte **ppByte, const T *data, double maxZError,
+                       int threads, int pixel_stride) const
+{
+    InfoFromComputeNumBytes info;
+    size_t nRemainingBytes = computeNumBytesNeededToWrite(
+        data, maxZError, info, threads, pixel_stride);
+    return write(ppByte, nRemainingBytes, data, info, threads, pixel_stride);
+}
+
+template <typename T>
+bool Lerc1Image::write(Byte **ppByte, size_t &nRemainingBytes, const T *data,
+                       const InfoFromComputeNumBytes &info, int threads,
+                       int pixel_stride) const
 {
 // Local macro, write an unaligned variable, adjust pointer
 #define WRVAR(VAR, PTR)                                                        \
     memcpy((PTR), &(VAR), sizeof(VAR));                                        \
     (PTR) += sizeof(VAR)
-    if (getSize() == 0)
+    if (getSize() == 0 || !data || pixel_stride < 1 || 0 == info.numBytes ||
+        info.numBytes > nRemainingBytes)
         return false;
+    Byte *ptr = *ppByte;
 
     // signature
-    memcpy(*ppByte, sCntZImage.c_str(), sCntZImage.size());
-    *ppByte += sCntZImage.size();
+    memcpy(ptr, sCntZImage.c_str(), sCntZImage.size());
+    ptr += sCntZImage.size();
 
     int height = getHeight();
     int width = getWidth();
-    WRVAR(CNT_Z_VER, *ppByte);
-    WRVAR(CNT_Z, *ppByte);
-    WRVAR(height, *ppByte);
-    WRVAR(width, *ppByte);
-    WRVAR(maxZError, *ppByte);
-    bool zPart(false);
-
-    InfoFromComputeNumBytes info;
-    if (0 == computeNumBytesNeededToWrite(maxZError, zPart, &info))
-        return false;
+    WRVAR(CNT_Z_VER, ptr);
+    WRVAR(CNT_Z, ptr);
+    WRVAR(height, ptr);
+    WRVAR(width, ptr);
+    WRVAR(info.maxZError, ptr);
 
+    bool zPart(false);
     do
     {
         int numTilesVert, numTilesHori, numBytesOpt, numBytesWritten = 0;
@@ -391,30 +503,34 @@ bool Lerc1Image::write(Byte **ppByte, double maxZError) const
             maxValInImg = info.maxZInImg;
         }
 
-        WRVAR(numTilesVert, *ppByte);
-        WRVAR(numTilesHori, *ppByte);
-        WRVAR(numBytesOpt, *ppByte);
-        WRVAR(maxValInImg, *ppByte);
+        WRVAR(numTilesVert, ptr);
+        WRVAR(numTilesHori, ptr);
+        WRVAR(numBytesOpt, ptr);
+        WRVAR(maxValInImg, ptr);
 
         if (!zPart && numTilesVert == 0 && numTilesHori == 0)
         {                         // no tiling for cnt part
             if (numBytesOpt > 0)  // cnt part is binary mask, use fast RLE class
-                numBytesWritten = mask.RLEcompress(*ppByte);
+                numBytesWritten = mask.RLEcompress(ptr);
         }
         else
         {  // encode tiles to buffer, always z part
             float maxVal;
-            if (!writeTiles(maxZError, numTilesVert, numTilesHori, *ppByte,
-                            numBytesWritten, maxVal))
+            if (!writeTiles(data, pixel_stride, info.maxZError, numTilesVert,
+                            numTilesHori, info.zStats, ptr, numBytesWritten,
+                            maxVal, threads))
                 return false;
         }
 
         if (numBytesWritten != numBytesOpt)
             return false;
 
-        *ppByte += numBytesWritten;
+        ptr += numBytesWritten;
         zPart = !zPart;
     } while (zPart);
+
+    nRemainingBytes -= ptr - *ppByte;
+    *ppByte = ptr;
     return true;
 #undef WRVAR
 }
@@ -423,6 +539,19 @@ bool Lerc1Image::write(Byte **ppByte, double maxZError) const
 static size_t TOO_LARGE = 1800 * 1000 * 1000 / static_cast<int>(sizeof(float));
 
 bool Lerc1Image::read(Byte **ppByte, size_t &nRemainingBytes, double maxZError)
+{
+    int width = 0, height = 0;
+    if (!getwh(*ppByte, nRemainingBytes, width, height))
+        return false;
+    setsize(width, height);
+    return read(ppByte, nRemainingBytes, maxZError, values.data(),
+                width * sizeof(float), 0.0f);
+}
+
+template <typename T>
+bool Lerc1Image::read(Byte **ppByte, size_t &nRemainingBytes, double maxZError,
+                      T *buffer, size_t line_stride, T ndv, int threads,
+                      int pixel_stride)
 {
 // Local macro, read an unaligned variable, adjust pointer
 #define RDVAR(PTR, VAR)                                                        \
@@ -457,11 +586,14 @@ bool Lerc1Image::read(Byte **ppByte, size_t &nRemainingBytes, double maxZError)
     if (width <= 0 || width > 20000 || height <= 0 || height > 20000 ||
         maxZErrorInFile > maxZError)
         return false;
-    if (static_cast<size_t>(width) * height > TOO_LARGE)
+    if (static_cast<size_t>(width) * height > TOO_LARGE || pixel_stride < 1)
         return false;
 
-    // Resize clears the buffer
-    resize(width, height);
+    // Only the mask, the values go to the buffer
+    width_ = width;
+    height_ = height;
+    mask.resize(width, height);
+    allValid = false;
     bool ZPart(false);
     do
     {
@@ -480,7 +612,8 @@ bool Lerc1Image::read(Byte **ppByte, size_t &nRemainingBytes, double maxZError)
         if (ZPart)
         {
             if (!readTiles(maxZErrorInFile, numTilesVert, numTilesHori,
-                           maxValInImg, *ppByte, numBytes))
+                           maxValInImg, *ppByte, numBytes, buffer, line_stride,
+                           pixel_stride, ndv, threads))
                 return false;
         }
         else
@@ -494,6 +627,7 @@ bool Lerc1Image::read(Byte **ppByte, size_t &nRemainingBytes, double maxZError)
                 bool v = (maxValInImg != 0.0);
                 for (int k = 0; k < getSize(); k++)
                     mask.Set(k, v);
+                allValid = v;
             }
             else
             {  // cnt part is binary mask, RLE compressed
@@ -546,38 +680,167 @@ bool Lerc1Image::getwh(const Byte *pByte, size_t nBytes, int &width,
 #undef RDVAR
 }
 
-bool Lerc1Image::findTiling(double maxZError, int &numTilesVertA,
-                            int &numTilesHoriA, int &numBytesOptA,
-                            float &maxValInImgA) const
+void Lerc1Image::ZStats::add(const ZStats &other)
+{
+    if (other.numValidPixel == 0)
+        return;
+    if (numValidPixel == 0)
+    {
+        *this = other;
+        return;
+    }
+    if (numFinite != numValidPixel || other.numFinite != other.numValidPixel)
+        zMin = NAN;
+    else
+        zMin = std::min(zMin, other.zMin);
+    zMax = std::max(zMax, other.zMax);
+    numValidPixel += other.numValidPixel;
+    numFinite += other.numFinite;
+}
+
+// The tile edges of all the tilings split the image in cells, each cell is
+// inside a single tile of every tiling. The cell stats are computed once, then
+// added to the tiles that contain them
+// With threads, each thread takes a range of cell rows and adds them to its
+// own copy of the tile rows it touches, merged at the end
+template <typename T>
+void Lerc1Image::tileStats(const T *data, int pixel_stride,
+                           std::vector<Tiling> &tilings, int threads) const
+{
+    std::vector<int> rows, cols;
+    for (auto &t : tilings)
+    {
+        int tileHeight = getHeight() / t.numTilesVert;
+        int tileWidth = getWidth() / t.numTilesHori;
+        for (int r = 0; r < getHeight(); r += tileHeight)
+            rows.push_back(r);
+        for (int c = 0; c < getWidth(); c += tileWidth)
+            cols.push_back(c);
+        t.stats.assign(static_cast<size_t>(rows.back() / tileHeight + 1) *
+                           (cols.back() / tileWidth + 1),
+                       ZStats());
+    }
+    std::sort(rows.begin(), rows.end());
+    rows.erase(std::unique(rows.begin(), rows.end()), rows.end());
+    std::sort(cols.begin(), cols.end());
+    cols.erase(std::unique(cols.begin(), cols.end()), cols.end());
+    cols.push_back(getWidth());
+
+    size_t nbands = rows.size();
+    rows.push_back(getHeight());
+    size_t nchunks = std::min(nbands, static_cast<size_t>(std::max(threads, 1)));
+    // Per chunk and tiling, the first tile row and the partial stats
+    std::vector<std::vector<std::pair<int, std::vector<ZStats>>>> partial(
+        nchunks,
+        std::vector<std::pair<int, std::vector<ZStats>>>(tilings.size()));
+    parallel_for(nchunks, threads,
+                 [&](size_t chunk)
+                 {
+                     size_t b0 = nbands * chunk / nchunks;
+                     size_t b1 = nbands * (chunk + 1) / nchunks;
+                     auto &tiles = partial[chunk];
+                     for (size_t k = 0; k < tilings.size(); k++)
+                     {
+                         int tileHeight = getHeight() / tilings[k].numTilesVert;
+                         int tilesPerRow = (getWidth() - 1) /
+                                               (getWidth() / tilings[k].numTilesHori) +
+                                           1;
+                         tiles[k].first = rows[b0] / tileHeight;
+                         tiles[k].second.assign(
+                             static_cast<size_t>(rows[b1 - 1] / tileHeight -
+                                                 tiles[k].first + 1) *
+                                 tilesPerRow,
+                             ZStats());
+                     }
+
+                     std::vector<ZStats> band(cols.size() - 1);
+                     for (size_t i = b0; i < b1; i++)
+                     {
+                         bandStats(data, pixel_stride, rows[i], rows[i + 1],
+                                   cols, band);
+                         for (size_t k = 0; k < tilings.size(); k++)
+                         {
+                             int tileHeight =
+                                 getHeight() / tilings[k].numTilesVert;
+                             int tileWidth = getWidth() / tilings[k].numTilesHori;
+                             int tilesPerRow = (getWidth() - 1) / tileWidth + 1;
+                             auto t = &tiles[k].second[static_cast<size_t>(
+                                                           rows[i] / tileHeight -
+                                                           tiles[k].first) *
+                                                       tilesPerRow];
+                             for (size_t j = 0; j < band.size(); j++)
+                                 t[cols[j] / tileWidth].add(band[j]);
+                         }
+                     }
+                 });
+
+    for (auto &tiles : partial)
+        for (size_t k = 0; k < tilings.size(); k++)
+        {
+            int tilesPerRow = (getWidth() - 1) /
+                                  (getWidth() / tilings[k].numTilesHori) +
+                              1;
+            auto t = &tilings[k].stats[static_cast<size_t>(tiles[k].first) *
+                                       tilesPerRow];
+            for (auto &s : tiles[k].second)
+                (t++)->add(s);
+        }
+}
+
+template <typename T>
+bool Lerc1Image::findTiling(const T *data, int pixel_stride, double maxZError,
+                            int &numTilesVertA, int &numTilesHoriA,
+                            int &numBytesOptA, float &maxValInImgA,
+                            std::vector<ZStats> &statsA, int threads) const
 {
     // entire image as 1 block, this is usually the worst case
-    numTilesVertA = numTilesHoriA = 1;
-    if (!writeTiles(maxZError, 1, 1, nullptr, numBytesOptA, maxValInImgA))
-        return false;
+    std::vector<Tiling> tilings(1);
+    tilings[0].numTilesVert = tilings[0].numTilesHori = 1;
     // The actual figure may be different due to round-down
     static const std::vector<int> tileWidthArr = {8, 11, 15, 20, 32, 64};
     for (auto tileWidth : tileWidthArr)
     {
         int numTilesVert = static_cast<int>(getHeight() / tileWidth);
         int numTilesHori = static_cast<int>(getWidth() / tileWidth);
-
         if (numTilesVert * numTilesHori < 2)
-            return true;
+            break;
+        tilings.push_back({numTilesVert, numTilesHori, {}});
+    }
+    tileStats(data, pixel_stride, tilings, threads);
+
+    // Size of every candidate, concurrently
+    std::vector<int> sizes(tilings.size());
+    std::vector<float> maxVals(tilings.size());
+    std::atomic<bool> ok(true);
+    parallel_for(tilings.size(), threads,
+                 [&](size_t i)
+                 {
+                     if (!writeTiles(data, pixel_stride, maxZError,
+                                     tilings[i].numTilesVert,
+                                     tilings[i].numTilesHori, tilings[i].stats,
+                                     nullptr, sizes[i], maxVals[i]))
+                         ok = false;
+                 });
+    if (!ok)
+        return false;
 
-        int numBytes = 0;
-        float maxVal;
-        if (!writeTiles(maxZError, numTilesVert, numTilesHori, nullptr,
-                        numBytes, maxVal))
-            return false;
-        if (numBytes > numBytesOptA)
+    size_t best = 0;
+    numTilesVertA = numTilesHoriA = 1;
+    numBytesOptA = sizes[0];
+    maxValInImgA = maxVals[0];
+    for (size_t i = 1; i < tilings.size(); i++)
+    {
+        if (sizes[i] > numBytesOptA)
             break;  // Stop when size start to increase
-        if (numBytes < numBytesOptA)
+        if (sizes[i] < numBytesOptA)
         {
-            numTilesVertA = numTilesVert;
-            numTilesHoriA = numTilesHori;
-            numBytesOptA = numBytes;
+            numTilesVertA = tilings[i].numTilesVert;
+            numTilesHoriA = tilings[i].numTilesHori;
+            numBytesOptA = sizes[i];
+            best = i;
         }
     }
+    statsA.swap(tilings[best].stats);
     return true;
 }
 
@@ -596,6 +859,23 @@ static Byte *writeFlt(Byte *ptr, float z, int n)
     return ptr + n;
 }
 
+// Stored tiles hold the values as float
+template <typename T> static Byte *storeFlt(const T *v, int n, Byte *ptr)
+{
+    for (int i = 0; i < n; i++, ptr += sizeof(float))
+    {
+        float val = static_cast<float>(v[i]);
+        memcpy(ptr, &val, sizeof(float));
+    }
+    return ptr;
+}
+
+static Byte *storeFlt(const float *v, int n, Byte *ptr)
+{
+    memcpy(ptr, v, n * sizeof(float));
+    return ptr + n * sizeof(float);
+}
+
 // Only small, exact integer values return 1 or 2, otherwise 4
 static int numBytesFlt(float z)
 {
@@ -621,9 +901,59 @@ static int numBytesZTile(int nValues, float zMin, float zMax, double maxZError)
     return nb + 1 + numBytesUInt(nValues) + (nValues * nBits(maxElem) + 7) / 8;
 }
 
+template <typename T>
+int Lerc1Image::zTileBytes(const T *data, int pixel_stride,
+                           const ZStats &stats, int r0, int r1, int c0, int c1,
+                           double maxZError, float &zMin, bool &isConst) const
+{
+    int numValidPixel = stats.numValidPixel, numFinite = stats.numFinite;
+    float zMax = stats.zMax;
+    zMin = stats.zMin;
+    isConst = false;
+    if (numValidPixel == 0)
+        return 1;
+    if (numFinite == 0 && numValidPixel == (r1 - r0) * (c1 - c0) &&
+        isallsameval(data, pixel_stride, r0, r1, c0, c1))
+    {
+        isConst = true;
+        return 5;  // Stored as non-finite constant block
+    }
+    int numBytesNeeded = numBytesZTile(numValidPixel, zMin, zMax, maxZError);
+    // Try moving zMin up by almost maxZError,
+    // it may require fewer bytes
+    float zm = static_cast<float>(zMin + 0.999999 * maxZError);
+    if (numFinite == numValidPixel && zm <= zMax)
+    {
+        int nBN = numBytesZTile(numValidPixel, zm, zMax, maxZError);
+        // Maybe an int value for zMin saves a few bytes?
+        if (zMin < floorf(zm))
+        {
+            int nBNi = numBytesZTile(numValidPixel, floorf(zm), zMax, maxZError);
+            if (nBNi < nBN)
+            {
+                zm = floorf(zm);
+                nBN = nBNi;
+            }
+        }
+        if (nBN < numBytesNeeded)
+        {
+            zMin = zm;
+            numBytesNeeded = nBN;
+        }
+    }
+    return numBytesNeeded;
+}
+
 // Pass bArr == nullptr to estimate the size but skip the write
-bool Lerc1Image::writeTiles(double maxZError, int numTilesV, int numTilesH,
-                            Byte *bArr, int &numBytes, float &maxValInImg) const
+// The tile stats come from tileStats()
+// The tile sizes are known before writing, so each row of tiles can be written
+// by a different thread, straight to its place in the output
+template <typename T>
+bool Lerc1Image::writeTiles(const T *data, int pixel_stride, double maxZError,
+                            int numTilesV, int numTilesH,
+                            const std::vector<ZStats> &stats, Byte *bArr,
+                            int &numBytes, float &maxValInImg,
+                            int threads) const
 {
     if (numTilesV == 0 || numTilesH == 0)
         return false;
@@ -631,87 +961,90 @@ bool Lerc1Image::writeTiles(double maxZError, int numTilesV, int numTilesH,
     maxValInImg = -FLT_MAX;
     int tileHeight = static_cast<int>(getHeight() / numTilesV);
     int tileWidth = static_cast<int>(getWidth() / numTilesH);
-    for (int v0 = 0; v0 < getHeight(); v0 += tileHeight)
+    if (tileWidth <= 0 || tileHeight <= 0)
+        return false;
+    size_t tileRows = (getHeight() - 1) / tileHeight + 1;
+    size_t tilesPerRow = (getWidth() - 1) / tileWidth + 1;
+    if (stats.size() != tileRows * tilesPerRow)
+        return false;
+
+    // Offset of each tile row in the output
+    std::vector<int> rowOffset(tileRows + 1, 0);
+    auto tile = stats.begin();
+    for (size_t tr = 0; tr < tileRows; tr++)
     {
+        int v0 = static_cast<int>(tr) * tileHeight;
         int v1 = std::min(getHeight(), v0 + tileHeight);
-        for (int h0 = 0; h0 < getWidth(); h0 += tileWidth)
+        for (int h0 = 0; h0 < getWidth(); h0 += tileWidth, ++tile)
         {
             int h1 = std::min(getWidth(), h0 + tileWidth);
-            float zMin = 0, zMax = 0;
-            int numValidPixel = 0, numFinite = 0;
-            if (!computeZStats(v0, v1, h0, h1, zMin, zMax, numValidPixel,
-                               numFinite))
-                return false;
+            if (maxValInImg < tile->zMax)
+                maxValInImg = tile->zMax;
+            float zMin;
+            bool isConst;
+            numBytes += zTileBytes(data, pixel_stride, *tile, v0, v1, h0, h1,
+                                   maxZError, zMin, isConst);
+        }
+        rowOffset[tr + 1] = numBytes;
+    }
 
-            if (maxValInImg < zMax)
-                maxValInImg = zMax;
+    if (!bArr)  // Skip the write if no pointer was provided
+        return true;
 
-            int numBytesNeeded = 1;
-            if (numValidPixel != 0)
+    std::atomic<bool> ok(true);
+    parallel_for(
+        tileRows, threads,
+        [&](size_t tr)
+        {
+            Byte *ptr = bArr + rowOffset[tr];
+            int v0 = static_cast<int>(tr) * tileHeight;
+            int v1 = std::min(getHeight(), v0 + tileHeight);
+            auto t = stats.begin() + tr * tilesPerRow;
+            std::vector<unsigned int> qdata;
+            for (int h0 = 0; h0 < getWidth(); h0 += tileWidth, ++t)
             {
-                if (numFinite == 0 && numValidPixel == (v1 - v0) * (h1 - h0) &&
-                    isallsameval(v0, v1, h0, h1))
-                    numBytesNeeded = 5;  // Stored as non-finite constant block
-                else
-                {
-                    numBytesNeeded =
-                        numBytesZTile(numValidPixel, zMin, zMax, maxZError);
-                    // Try moving zMin up by almost maxZError,
-                    // it may require fewer bytes
-                    float zm = static_cast<float>(zMin + 0.999999 * maxZError);
-                    if (numFinite == numValidPixel && zm <= zMax)
-                    {
-                        int nBN =
-                            numBytesZTile(numValidPixel, zm, zMax, maxZError);
-                        // Maybe an int value for zMin saves a few bytes?
-                        if (zMin < floorf(zm))
-                        {
-                            int nBNi = numBytesZTile(numValidPixel, floorf(zm),
-                                                     zMax, maxZError);
-                            if (nBNi < nBN)
-                            {
-                                zm = floorf(zm);
-                                nBN = nBNi;
-                            }
-                        }
-                        if (nBN < numBytesNeeded)
-                        {
-                            zMin = zm;
-                            numBytesNeeded = nBN;
-                        }
-                    }
-                }
-            }
-            numBytes += numBytesNeeded;
-
-            if (bArr)
-            {  // Skip the write if no pointer was provided
+                int h1 = std::min(getWidth(), h0 + tileWidth);
+                float zMin;
+                bool isConst;
+                int numBytesNeeded =
+                    zTileBytes(data, pixel_stride, *t, v0, v1, h0, h1,
+                               maxZError, zMin, isConst);
                 int numBytesWritten = 0;
-                if (numFinite == 0 && numValidPixel == (v1 - v0) * (h1 - h0) &&
-                    isallsameval(v0, v1, h0, h1))
+                if (isConst)
                 {
                     // direct write as non-finite const block, 4 byte float
-                    *bArr++ = 3;  // 3 | bits67[3]
-                    bArr = writeFlt(bArr, (*this)(v0, h0), sizeof(float));
+                    *ptr++ = 3;  // 3 | bits67[3]
+                    ptr = storeFlt(data + (static_cast<size_t>(v0) * getWidth() +
+                                           h0) * pixel_stride,
+                                   1, ptr);
                     numBytesWritten = 5;
                 }
-                else
+                else if (!writeZTile(data, pixel_stride, &ptr, numBytesWritten,
+                                     v0, v1, h0, h1, t->numValidPixel, zMin,
+                                     t->zMax, maxZError, qdata))
                 {
-                    if (!writeZTile(&bArr, numBytesWritten, v0, v1, h0, h1,
-                                    numValidPixel, zMin, zMax, maxZError))
-                        return false;
+                    ok = false;
+                    return;
                 }
                 if (numBytesWritten != numBytesNeeded)
-                    return false;
+                {
+                    ok = false;
+                    return;
+                }
             }
-        }
-    }
-    return true;
+        });
+    return ok;
 }
 
+// Smaller images are decoded by a single thread
+static const int MIN_PARALLEL_DECODE = 512 * 512;
+
+template <typename T>
 bool Lerc1Image::readTiles(double maxZErrorInFile, int numTilesV, int numTilesH,
                            float maxValInImg, Byte *bArr,
-                           size_t nRemainingBytes)
+                           size_t nRemainingBytes, T *buffer,
+                           size_t line_stride, int pixel_stride, T ndv,
+                           int threads)
 {
     if (numTilesV == 0 || numTilesH == 0)
         return false;
@@ -719,69 +1052,471 @@ bool Lerc1Image::readTiles(double maxZErrorInFile, int numTilesV, int numTilesH,
     int tileWidth = static_cast<int>(getWidth() / numTilesH);
     if (tileWidth <= 0 || tileHeight <= 0)  // Prevent infinite loop
         return false;
-    for (int r0 = 0; r0 < getHeight(); r0 += tileHeight)
+    std::vector<unsigned int> idataVec;
+    if (threads < 2 || getHeight() <= tileHeight ||
+        getSize() < MIN_PARALLEL_DECODE)
+    {
+        for (int r0 = 0; r0 < getHeight(); r0 += tileHeight)
+        {
+            int r1 = std::min(getHeight(), r0 + tileHeight);
+            for (int c0 = 0; c0 < getWidth(); c0 += tileWidth)
+            {
+                int c1 = std::min(getWidth(), c0 + tileWidth);
+                if (!readZTile(&bArr, nRemainingBytes, r0, r1, c0, c1,
+                               maxZErrorInFile, maxValInImg, buffer,
+                               line_stride, pixel_stride, ndv, idataVec))
+                    return false;
+            }
+        }
+        return true;
+    }
+
+    // Index the start of each row of tiles from the tile headers, then decode
+    // the rows of tiles concurrently, each one into its own part of the buffer
+    size_t tileRows = (getHeight() - 1) / tileHeight + 1;
+    std::vector<size_t> rowOffset(tileRows + 1, 0);
+    size_t offset = 0;
+    for (size_t tr = 0; tr < tileRows; tr++)
     {
+        int r0 = static_cast<int>(tr) * tileHeight;
         int r1 = std::min(getHeight(), r0 + tileHeight);
         for (int c0 = 0; c0 < getWidth(); c0 += tileWidth)
         {
             int c1 = std::min(getWidth(), c0 + tileWidth);
-            if (!readZTile(&bArr, nRemainingBytes, r0, r1, c0, c1,
-                           maxZErrorInFile, maxValInImg))
+            size_t size = zTileSize(bArr + offset, nRemainingBytes - offset, r0,
+                                    r1, c0, c1);
+            if (0 == size)
                 return false;
+            offset += size;
         }
+        rowOffset[tr + 1] = offset;
     }
-    return true;
+
+    std::atomic<bool> ok(true);
+    parallel_for(tileRows, threads,
+                 [&](size_t tr)
+                 {
+                     std::vector<unsigned int> idata;
+                     Byte *ptr = bArr + rowOffset[tr];
+                     size_t size = rowOffset[tr + 1] - rowOffset[tr];
+                     int r0 = static_cast<int>(tr) * tileHeight;
+                     int r1 = std::min(getHeight(), r0 + tileHeight);
+                     for (int c0 = 0; ok && c0 < getWidth(); c0 += tileWidth)
+                     {
+                         int c1 = std::min(getWidth(), c0 + tileWidth);
+                         if (!readZTile(&ptr, size, r0, r1, c0, c1,
+                                        maxZErrorInFile, maxValInImg, buffer,
+                                        line_stride, pixel_stride, ndv, idata))
+                             ok = false;
+                     }
+                     if (size != 0)  // Should match the index
+                         ok = false;
+                 });
+    return ok;
 }
 
-bool Lerc1Image::computeZStats(int r0, int r1, int c0, int c1, float &zMin,
-                               float &zMax, int &numValidPixel,
-                               int &numFinite) const
+// Follows the same checks as readZTile and blockread
+size_t Lerc1Image::zTileSize(const Byte *pByte, size_t nRemainingBytes, int r0,
+                             int r1, int c0, int c1) const
 {
-    if (r0 < 0 || c0 < 0 || r1 > getHeight() || c1 > getWidth())
-        return false;
-    zMin = FLT_MAX;
-    zMax = -FLT_MAX;
-    numValidPixel = 0;
-    numFinite = 0;
+    if (nRemainingBytes < 1)
+        return 0;
+    Byte comprFlag = *pByte;
+    Byte n = stib67[comprFlag >> 6];
+    comprFlag &= 63;
+    // cppcheck-suppress knownConditionTrueFalse
+    if (n == 0 || comprFlag > 3)
+        return 0;
+    size_t size = 1;
+    if (comprFlag == 2)
+        return size;
+
+    if (comprFlag == 0)
+    {  // Stored, as many floats as valid pixels
+        size_t numValid = static_cast<size_t>(r1 - r0) * (c1 - c0);
+        if (!allValid)
+        {
+            numValid = 0;
+            for (int row = r0; row < r1; row++)
+                for (int k = row * getWidth() + c0; k < row * getWidth() + c1;
+                     k++)
+                    numValid += mask.IsValid(k);
+        }
+        size += numValid * sizeof(float);
+        return (size <= nRemainingBytes) ? size : 0;
+    }
+
+    size += n;  // min val
+    if (comprFlag == 3)
+        return (size <= nRemainingBytes) ? size : 0;
+
+    // Bit stuffed, numBits byte and the element count
+    if (nRemainingBytes < size + 1)
+        return 0;
+    Byte numBits = pByte[size];
+    n = stib67[numBits >> 6];
+    numBits &= 63;
+    // cppcheck-suppress knownConditionTrueFalse
+    if (numBits >= 32 || n == 0 || nRemainingBytes < size + 1 + n)
+        return 0;
+    unsigned int numElements = 0;
+    memcpy(&numElements, pByte + size + 1, n);
+    size += 1 + n;
+    if (static_cast<size_t>(numElements) >
+        static_cast<size_t>(r1 - r0) * (c1 - c0))
+        return 0;
+    size += (static_cast<size_t>(numElements) * numBits + 7) / 8;
+    return (size <= nRemainingBytes) ? size : 0;
+}
+
+// Min, max and count of finite values for n floats, NaNs are skipped by the
+// comparisons, same as in the scalar loop
+static void rangeStats(const float *v, int n, float &zMin, float &zMax,
+                       int &numFinite)
+{
+    int i = 0;
+#if defined(USE_SSE2)
+    if (n >= 8)
+    {
+        __m128 vmin = _mm_set1_ps(zMin), vmax = _mm_set1_ps(zMax);
+        const __m128i expMask = _mm_set1_epi32(0x7f800000);
+        __m128i nonFinite = _mm_setzero_si128();
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128 x = _mm_loadu_ps(v + i);
+            // Operand order matters, a NaN in x leaves the old value
+            vmin = _mm_min_ps(x, vmin);
+            vmax = _mm_max_ps(x, vmax);
+            __m128i e = _mm_and_si128(_mm_castps_si128(x), expMask);
+            // Subtracting -1 counts the lanes with all exponent bits set
+            nonFinite = _mm_sub_epi32(nonFinite, _mm_cmpeq_epi32(e, expMask));
+        }
+        float lo[4], hi[4];
+        int32_t cnt[4];
+        _mm_storeu_ps(lo, vmin);
+        _mm_storeu_ps(hi, vmax);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(cnt), nonFinite);
+        for (int j = 0; j < 4; j++)
+        {
+            zMin = (lo[j] < zMin) ? lo[j] : zMin;
+            zMax = (hi[j] > zMax) ? hi[j] : zMax;
+            numFinite -= cnt[j];
+        }
+        numFinite += i;
+    }
+#endif
+    for (; i < n; i++)
+    {
+        float val = v[i];
+        numFinite += std::isfinite(val);
+        zMin = (val < zMin) ? val : zMin;
+        zMax = (val > zMax) ? val : zMax;
+    }
+}
+
+// Min and max of integer values, in the native type
+template <typename T> static void minMax(const T *v, int n, T &lo, T &hi)
+{
+    for (int i = 0; i < n; i++)
+    {
+        lo = std::min(lo, v[i]);
+        hi = std::max(hi, v[i]);
+    }
+}
+
+#if defined(USE_SSE2)
+static void minMax(const Byte *v, int n, Byte &lo, Byte &hi)
+{
+    int i = 0;
+    if (n >= 16)
+    {
+        __m128i vlo = _mm_set1_epi8(static_cast<char>(lo));
+        __m128i vhi = _mm_set1_epi8(static_cast<char>(hi));
+        for (; i + 16 <= n; i += 16)
+        {
+            __m128i x =
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(v + i));
+            vlo = _mm_min_epu8(vlo, x);
+            vhi = _mm_max_epu8(vhi, x);
+        }
+        Byte l[16], h[16];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(l), vlo);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(h), vhi);
+        for (int j = 0; j < 16; j++)
+        {
+            lo = std::min(lo, l[j]);
+            hi = std::max(hi, h[j]);
+        }
+    }
+    minMax<Byte>(v + i, n - i, lo, hi);
+}
+
+// SSE2 only has signed 16 bit min and max, unsigned values get the sign
+// bit flipped
+template <typename T>
+static void minMax16(const T *v, int n, T &lo, T &hi, int16_t flip)
+{
+    int i = 0;
+    if (n >= 8)
+    {
+        const __m128i vflip = _mm_set1_epi16(flip);
+        __m128i vlo = _mm_set1_epi16(static_cast<int16_t>(lo ^ flip));
+        __m128i vhi = _mm_set1_epi16(static_cast<int16_t>(hi ^ flip));
+        for (; i + 8 <= n; i += 8)
+        {
+            __m128i x = _mm_xor_si128(
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(v + i)),
+                vflip);
+            vlo = _mm_min_epi16(vlo, x);
+            vhi = _mm_max_epi16(vhi, x);
+        }
+        int16_t l[8], h[8];
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(l), vlo);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(h), vhi);
+        for (int j = 0; j < 8; j++)
+        {
+            lo = std::min(lo, static_cast<T>(l[j] ^ flip));
+            hi = std::max(hi, static_cast<T>(h[j] ^ flip));
+        }
+    }
+    minMax<T>(v + i, n - i, lo, hi);
+}
+
+static void minMax(const int16_t *v, int n, int16_t &lo, int16_t &hi)
+{
+    minMax16(v, n, lo, hi, 0);
+}
+
+static void minMax(const uint16_t *v, int n, uint16_t &lo, uint16_t &hi)
+{
+    minMax16(v, n, lo, hi, static_cast<int16_t>(0x8000));
+}
+#endif
+
+// Integers are always finite, the float conversion keeps the order
+template <typename T>
+static void rangeStats(const T *v, int n, float &zMin, float &zMax,
+                       int &numFinite)
+{
+    if (n <= 0)
+        return;
+    T lo = v[0], hi = v[0];
+    minMax(v, n, lo, hi);
+    zMin = std::min(zMin, static_cast<float>(lo));
+    zMax = std::max(zMax, static_cast<float>(hi));
+    numFinite += n;
+}
+
+template <typename T>
+void Lerc1Image::bandStats(const T *data, int pixel_stride, int r0, int r1,
+                           const std::vector<int> &cols,
+                           std::vector<ZStats> &band) const
+{
+    for (auto &s : band)
+    {
+        s.zMin = FLT_MAX;
+        s.zMax = -FLT_MAX;
+        s.numValidPixel = s.numFinite = 0;
+    }
     for (int row = r0; row < r1; row++)
-        for (int col = c0; col < c1; col++)
-            if (IsValid(row, col))
+    {
+        const T *v = data + static_cast<size_t>(row) * getWidth() * pixel_stride;
+        int k = row * getWidth();
+        for (size_t j = 0; j < band.size(); j++)
+        {
+            auto &s = band[j];
+            float zMin = s.zMin, zMax = s.zMax;
+            int numValidPixel = 0, numFinite = 0;
+            if (allValid && 1 == pixel_stride)
             {
-                numValidPixel++;
-                float val = (*this)(row, col);
-                if (std::isfinite(val))
-                    numFinite++;
-                else
-                    zMin = NAN;  // Serves as a flag, this block will be stored
-                if (val < zMin)
-                    zMin = val;
-                if (val > zMax)
-                    zMax = val;
+                numValidPixel = cols[j + 1] - cols[j];
+                rangeStats(v + cols[j], numValidPixel, zMin, zMax, numFinite);
             }
-    if (0 == numValidPixel)
-        zMin = zMax = 0;
-    return true;
+            else
+                for (int col = cols[j]; col < cols[j + 1]; col++)
+                {
+                    if (!allValid && !mask.IsValid(k + col))
+                        continue;
+                    float val = static_cast<float>(v[col * pixel_stride]);
+                    numValidPixel++;
+                    numFinite += std::isfinite(val);
+                    zMin = (val < zMin) ? val : zMin;
+                    zMax = (val > zMax) ? val : zMax;
+                }
+            s.zMin = zMin;
+            s.zMax = zMax;
+            s.numValidPixel += numValidPixel;
+            s.numFinite += numFinite;
+        }
+    }
+    for (auto &s : band)
+    {
+        if (0 == s.numValidPixel)
+            s.zMin = s.zMax = 0;
+        else if (s.numFinite != s.numValidPixel)
+            s.zMin = NAN;  // Serves as a flag, this block will be stored
+    }
 }
 
 // Returns true if all floats in the region have exactly the same binary
 // representation This makes it usable for non-finite values
-bool Lerc1Image::isallsameval(int r0, int r1, int c0, int c1) const
+template <typename T>
+bool Lerc1Image::isallsameval(const T *data, int pixel_stride, int r0, int r1,
+                              int c0, int c1) const
 {
-    uint32_t val = *reinterpret_cast<const uint32_t *>(&(*this)(r0, c0));
+    const T *val = data + (static_cast<size_t>(r0) * getWidth() + c0) * pixel_stride;
     for (int row = r0; row < r1; row++)
+    {
+        const T *v = data + static_cast<size_t>(row) * getWidth() * pixel_stride;
         for (int col = c0; col < c1; col++)
-            if (val != *reinterpret_cast<const uint32_t *>(&(*this)(row, col)))
+            if (memcmp(val, v + col * pixel_stride, sizeof(T)))
                 return false;
+    }
     return true;
 }
 
+// (v - zMin) * f + 0.5, truncated
+// The math is in double, the value is converted to float first
+template <typename T>
+static inline unsigned int quantize(T v, float zMin, double f)
+{
+    return static_cast<unsigned int>(
+        ((double)static_cast<float>(v) - zMin) * f + 0.5);
+}
+
+template <typename T>
+static void quantize(const T *v, int n, float zMin, double f,
+                     unsigned int *out)
+{
+    for (int i = 0; i < n; i++)
+        out[i] = quantize(v[i], zMin, f);
+}
+
+#if defined(USE_SSE2)
+// Results fit in 28 bits, the signed conversion is fine
+static inline __m128i quantize4(__m128d lo, __m128d hi, __m128d vmin,
+                                __m128d vf)
+{
+    const __m128d half = _mm_set1_pd(0.5);
+    lo = _mm_add_pd(_mm_mul_pd(_mm_sub_pd(lo, vmin), vf), half);
+    hi = _mm_add_pd(_mm_mul_pd(_mm_sub_pd(hi, vmin), vf), half);
+    return _mm_unpacklo_epi64(_mm_cvttpd_epi32(lo), _mm_cvttpd_epi32(hi));
+}
+
+static inline __m128i quantize4(__m128 x, __m128d vmin, __m128d vf)
+{
+    return quantize4(_mm_cvtps_pd(x), _mm_cvtps_pd(_mm_movehl_ps(x, x)),
+                     vmin, vf);
+}
+
+// Four values, widened to 32 bit integers
+static inline __m128i load4(const Byte *p)
+{
+    int32_t w;
+    memcpy(&w, p, sizeof(w));
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(w), zero),
+                              zero);
+}
+
+static inline __m128i load4(const uint16_t *p)
+{
+    return _mm_unpacklo_epi16(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p)),
+        _mm_setzero_si128());
+}
+
+static inline __m128i load4(const int16_t *p)
+{
+    __m128i x = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+    return _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+}
+
+static inline __m128i load4(const int32_t *p)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
+
+static void quantize(const float *v, int n, float zMin, double f,
+                     unsigned int *out)
+{
+    const __m128d vmin = _mm_set1_pd(zMin), vf = _mm_set1_pd(f);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                         quantize4(_mm_loadu_ps(v + i), vmin, vf));
+    quantize<float>(v + i, n - i, zMin, f, out + i);
+}
+
+// Up to 16 bits, integers are exact as float or double. For an integer zMin
+// and f == 1, which is the lossless case, quantization is a subtraction
+template <typename T>
+static void quantizeInt(const T *v, int n, float zMin, double f,
+                        unsigned int *out)
+{
+    int i = 0;
+    auto o = reinterpret_cast<__m128i *>(out);
+    if (f == 1 && zMin == std::floor(zMin))
+    {
+        const __m128i vmin = _mm_set1_epi32(static_cast<int>(zMin));
+        for (; i + 4 <= n; i += 4)
+            _mm_storeu_si128(o++, _mm_sub_epi32(load4(v + i), vmin));
+    }
+    else
+    {
+        const __m128d vmin = _mm_set1_pd(zMin), vf = _mm_set1_pd(f);
+        for (; i + 4 <= n; i += 4)
+        {
+            __m128i x = load4(v + i);
+            _mm_storeu_si128(o++, quantize4(_mm_cvtepi32_pd(x),
+                                            _mm_cvtepi32_pd(_mm_srli_si128(x, 8)),
+                                            vmin, vf));
+        }
+    }
+    quantize<T>(v + i, n - i, zMin, f, out + i);
+}
+
+static void quantize(const Byte *v, int n, float zMin, double f,
+                     unsigned int *out)
+{
+    quantizeInt(v, n, zMin, f, out);
+}
+
+static void quantize(const uint16_t *v, int n, float zMin, double f,
+                     unsigned int *out)
+{
+    quantizeInt(v, n, zMin, f, out);
+}
+
+static void quantize(const int16_t *v, int n, float zMin, double f,
+                     unsigned int *out)
+{
+    quantizeInt(v, n, zMin, f, out);
+}
+
+// Larger values are not exact as float, convert them first
+static void quantize(const int32_t *v, int n, float zMin, double f,
+                     unsigned int *out)
+{
+    const __m128d vmin = _mm_set1_pd(zMin), vf = _mm_set1_pd(f);
+    int i = 0;
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i),
+                         quantize4(_mm_cvtepi32_ps(load4(v + i)), vmin, vf));
+    quantize<int32_t>(v + i, n - i, zMin, f, out + i);
+}
+#endif
+
 //
 // Assumes that buffer at *ppByte is large enough for this particular block
 // Returns number of bytes used in numBytes
 //
-bool Lerc1Image::writeZTile(Byte **ppByte, int &numBytes, int r0, int r1,
-                            int c0, int c1, int numValidPixel, float zMin,
-                            float zMax, double maxZError) const
+template <typename T>
+bool Lerc1Image::writeZTile(const T *data, int pixel_stride, Byte **ppByte,
+                            int &numBytes, int r0, int r1, int c0, int c1,
+                            int numValidPixel, float zMin, float zMax,
+                            double maxZError,
+                            std::vector<unsigned int> &qdata) const
 {
     Byte *ptr = *ppByte;
     int cntPixel = 0;
@@ -795,14 +1530,24 @@ bool Lerc1Image::writeZTile(Byte **ppByte, int &numBytes, int r0, int r1,
         ((double)zMax - zMin) / (2 * maxZError) > MAXQ)
     {  // store valid pixels as floating point
         *ptr++ = 0;
-        for (int row = r0; row < r1; row++)
-            for (int col = c0; col < c1; col++)
-                if (IsValid(row, col))
-                {
-                    memcpy(ptr, &((*this)(row, col)), sizeof(float));
-                    ptr += sizeof(float);
-                    cntPixel++;
-                }
+        if (allValid && 1 == pixel_stride)
+        {
+            for (int row = r0; row < r1; row++)
+                ptr = storeFlt(data + static_cast<size_t>(row) * getWidth() + c0,
+                               c1 - c0, ptr);
+            cntPixel = (r1 - r0) * (c1 - c0);
+        }
+        else
+            for (int row = r0; row < r1; row++)
+                for (int col = c0; col < c1; col++)
+                    if (IsValid(row, col))
+                    {
+                        ptr = storeFlt(data + (static_cast<size_t>(row) *
+                                                   getWidth() +
+                                               col) * pixel_stride,
+                                       1, ptr);
+                        cntPixel++;
+                    }
         if (cntPixel != numValidPixel)
             return false;
     }
@@ -827,36 +1572,60 @@ bool Lerc1Image::writeZTile(Byte **ppByte, int &numBytes, int r0, int r1,
             memcpy(ptr, &numValidPixel, n);
             ptr += n;
 
-            unsigned int acc = 0;  // Accumulator
-            int bits = 32;         // Available
-
-            for (int row = r0; row < r1; row++)
-                for (int col = c0; col < c1; col++)
-                    if (IsValid(row, col))
-                    {
-                        cntPixel++;
-                        auto val = static_cast<unsigned int>(
-                            ((double)(*this)(row, col) - zMin) * f + 0.5);
-
-                        if (bits >= numBits)
-                        {  // no accumulator overflow
-                            acc |= val << (bits - numBits);
-                            bits -= numBits;
-                        }
-                        else
-                        {  // accum overflowing
-                            acc |= val >> (numBits - bits);
-                            memcpy(ptr, &acc, sizeof(acc));
-                            ptr += sizeof(acc);
-                            bits += 32 - numBits;  // under 32
-                            acc = val << bits;
+            qdata.resize(numValidPixel);
+            unsigned int *q = qdata.data();
+            if (allValid && 1 == pixel_stride &&
+                numValidPixel == (r1 - r0) * (c1 - c0))
+            {
+                for (int row = r0; row < r1; row++, q += c1 - c0)
+                    quantize(data + static_cast<size_t>(row) * getWidth() + c0,
+                             c1 - c0, zMin, f, q);
+                cntPixel = numValidPixel;
+            }
+            else
+                for (int row = r0; row < r1; row++)
+                    for (int col = c0; col < c1; col++)
+                        if (IsValid(row, col))
+                        {
+                            if (cntPixel++ == numValidPixel)
+                                return false;
+                            *q++ = quantize(data[(static_cast<size_t>(row) *
+                                                      getWidth() +
+                                                  col) * pixel_stride],
+                                            zMin, f);
                         }
-                    }
-
             if (cntPixel != numValidPixel)
                 return false;
 
-            // There are between 1 and 4 bytes left in the accumulator
+            // Whole groups of 32 values fill exactly numBits words
+            auto pack = packers[numBits];
+            const unsigned int *val = qdata.data();
+            for (int i = numValidPixel / 32; i; i--, val += 32)
+            {
+                pack(val, ptr);
+                ptr += numBits * 4;
+            }
+
+            unsigned int acc = 0;  // Accumulator
+            int bits = 32;         // Available
+            for (auto end = qdata.data() + numValidPixel; val < end; val++)
+            {
+                if (bits >= numBits)
+                {  // no accumulator overflow
+                    acc |= *val << (bits - numBits);
+                    bits -= numBits;
+                }
+                else
+                {  // accum overflowing
+                    acc |= *val >> (numBits - bits);
+                    memcpy(ptr, &acc, sizeof(acc));
+                    ptr += sizeof(acc);
+                    bits += 32 - numBits;  // under 32
+                    acc = *val << bits;
+                }
+            }
+
+            // There are between 0 and 4 bytes left in the accumulator
             int nbytes = 4;
             while (bits >= 8)
             {
@@ -893,9 +1662,135 @@ static float readFlt(const Byte *ptr, int n)
     return static_cast<float>(static_cast<signed char>(*ptr));
 }
 
+// out[i] = min(maxZInImg, minval + q * in[i]), converted to T
+// The math is in double, same as the scalar code
+template <typename T>
+static void dequantize(const unsigned int *in, int n, float minval, double q,
+                       float maxZInImg, T *out)
+{
+    int i = 0;
+#if defined(USE_SSE2)
+    const __m128d vmin = _mm_set1_pd(minval);
+    const __m128d vq = _mm_set1_pd(q);
+    const __m128 vmax = _mm_set1_ps(maxZInImg);
+    // Values have at most 31 bits, signed conversion is fine
+    for (; i + 4 <= n; i += 4)
+    {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + i));
+        __m128d lo = _mm_add_pd(vmin, _mm_mul_pd(vq, _mm_cvtepi32_pd(v)));
+        __m128d hi = _mm_add_pd(
+            vmin, _mm_mul_pd(vq, _mm_cvtepi32_pd(_mm_srli_si128(v, 8))));
+        __m128 f = _mm_min_ps(_mm_movelh_ps(_mm_cvtpd_ps(lo), _mm_cvtpd_ps(hi)),
+                              vmax);
+        if (std::is_same<T, float>::value)
+            _mm_storeu_ps(reinterpret_cast<float *>(out + i), f);
+        else
+        {
+            float t[4];
+            _mm_storeu_ps(t, f);
+            for (int j = 0; j < 4; j++)
+                out[i + j] = static_cast<T>(t[j]);
+        }
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = static_cast<T>(
+            std::min(maxZInImg, static_cast<float>(minval + q * in[i])));
+}
+
+// Integer outputs take a shortcut when the values are integers, q is 1 and
+// minval and maxZInImg are exact integers. Returns false if it doesn't apply
+// Results are the same as the double math
+static bool dequantizeInt(const unsigned int *, int, float, double, float,
+                          float *)
+{
+    return false;
+}
+
+#if defined(USE_SSE2)
+// Eight 32 bit values to T, keeping the low bits, like a static_cast
+static inline void store8(__m128i a, __m128i b, Byte *out)
+{
+    const __m128i m = _mm_set1_epi32(0xff);
+    __m128i x = _mm_packs_epi32(_mm_and_si128(a, m), _mm_and_si128(b, m));
+    _mm_storel_epi64(reinterpret_cast<__m128i *>(out), _mm_packus_epi16(x, x));
+}
+
+static inline void store8(__m128i a, __m128i b, int16_t *out)
+{
+    a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+    b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_packs_epi32(a, b));
+}
+
+static inline void store8(__m128i a, __m128i b, uint16_t *out)
+{
+    store8(a, b, reinterpret_cast<int16_t *>(out));
+}
+
+static inline void store8(__m128i a, __m128i b, int32_t *out)
+{
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out), a);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 4), b);
+}
+
+static inline void store8(__m128i a, __m128i b, uint32_t *out)
+{
+    store8(a, b, reinterpret_cast<int32_t *>(out));
+}
+#endif
+
+template <typename T>
+static bool dequantizeInt(const unsigned int *in, int n, float minval,
+                          double q, float maxZInImg, T *out)
+{
+    // Within 2^24, integers are exact as float
+    if (q != 1 || minval != std::floor(minval) ||
+        maxZInImg != std::floor(maxZInImg) || std::fabs(minval) > 0x1000000 ||
+        std::fabs(maxZInImg) > 0x1000000 || maxZInImg < minval)
+        return false;
+    int zmin = static_cast<int>(minval), zmax = static_cast<int>(maxZInImg);
+    // Larger inputs are clipped to zmax
+    unsigned int limit = static_cast<unsigned int>(zmax - zmin);
+    int i = 0;
+#if defined(USE_SSE2)
+    // Inputs have at most 31 bits, the signed compare works
+    const __m128i vmin = _mm_set1_epi32(zmin), vmax = _mm_set1_epi32(zmax);
+    const __m128i vlimit = _mm_set1_epi32(static_cast<int>(limit));
+    auto v = reinterpret_cast<const __m128i *>(in);
+    for (; i + 8 <= n; i += 8, v += 2)
+    {
+        __m128i a = _mm_loadu_si128(v), b = _mm_loadu_si128(v + 1);
+        __m128i ma = _mm_cmpgt_epi32(a, vlimit), mb = _mm_cmpgt_epi32(b, vlimit);
+        a = _mm_or_si128(_mm_and_si128(ma, vmax),
+                         _mm_andnot_si128(ma, _mm_add_epi32(a, vmin)));
+        b = _mm_or_si128(_mm_and_si128(mb, vmax),
+                         _mm_andnot_si128(mb, _mm_add_epi32(b, vmin)));
+        store8(a, b, out + i);
+    }
+#endif
+    for (; i < n; i++)
+        out[i] = static_cast<T>(
+            (in[i] > limit) ? zmax : zmin + static_cast<int>(in[i]));
+    return true;
+}
+
+// Start of a row in a strided buffer
+template <typename T>
+static inline T *rowPtr(T *buffer, size_t line_stride, int row)
+{
+    return reinterpret_cast<T *>(reinterpret_cast<Byte *>(buffer) +
+                                 line_stride * row);
+}
+
+// Converts and writes each tile value straight into the output buffer, in the
+// same pass invalid pixels get the ndv
+template <typename T>
 bool Lerc1Image::readZTile(Byte **ppByte, size_t &nRemainingBytes, int r0,
                            int r1, int c0, int c1, double maxZErrorInFile,
-                           float maxZInImg)
+                           float maxZInImg, T *buffer, size_t line_stride,
+                           int pixel_stride, T ndv,
+                           std::vector<unsigned int> &idataVec) const
 {
     Byte *ptr = *ppByte;
 
@@ -910,11 +1805,28 @@ bool Lerc1Image::readZTile(Byte **ppByte, size_t &nRemainingBytes, int r0,
     if (n == 0 || comprFlag > 3)
         return false;
 
-    if (comprFlag == 2)
-    {  // entire zTile is 0
+    if (comprFlag == 2 || comprFlag == 3)
+    {  // Constant tile, 0 or min val
+        float minval = 0.0f;
+        if (comprFlag == 3)
+        {
+            if (nRemainingBytes < n)
+                return false;
+            minval = readFlt(ptr, n);
+            ptr += n;
+            nRemainingBytes -= n;
+        }
+        const T val = static_cast<T>(minval);
         for (int row = r0; row < r1; row++)
-            for (int col = c0; col < c1; col++)
-                (*this)(row, col) = 0.0f;
+        {
+            T *out = rowPtr(buffer, line_stride, row) + c0 * pixel_stride;
+            int k = row * getWidth() + c0;
+            if (allValid && 1 == pixel_stride)
+                std::fill(out, out + (c1 - c0), val);
+            else
+                for (int col = c0; col < c1; col++, out += pixel_stride)
+                    *out = (allValid || mask.IsValid(k++)) ? val : ndv;
+        }
         *ppByte = ptr;
         return true;
     }
@@ -922,15 +1834,26 @@ bool Lerc1Image::readZTile(Byte **ppByte, size_t &nRemainingBytes, int r0,
     if (comprFlag == 0)
     {  // Stored
         for (int row = r0; row < r1; row++)
-            for (int col = c0; col < c1; col++)
-                if (IsValid(row, col))
+        {
+            T *out = rowPtr(buffer, line_stride, row) + c0 * pixel_stride;
+            int k = row * getWidth() + c0;
+            for (int col = c0; col < c1; col++, out += pixel_stride)
+            {
+                if (allValid || mask.IsValid(k))
                 {
                     if (nRemainingBytes < sizeof(float))
                         return false;
-                    memcpy(&(*this)(row, col), ptr, sizeof(float));
+                    float val;
+                    memcpy(&val, ptr, sizeof(float));
                     ptr += sizeof(float);
                     nRemainingBytes -= sizeof(float);
+                    *out = static_cast<T>(val);
                 }
+                else
+                    *out = ndv;
+                k++;
+            }
+        }
         *ppByte = ptr;
         return true;
     }
@@ -941,31 +1864,45 @@ bool Lerc1Image::readZTile(Byte **ppByte, size_t &nRemainingBytes, int r0,
     ptr += n;
     nRemainingBytes -= n;
 
-    if (comprFlag == 3)
-    {  // all min val, regardless of mask
-        for (int row = r0; row < r1; row++)
-            for (int col = c0; col < c1; col++)
-                (*this)(row, col) = minval;
-        *ppByte = ptr;
-        return true;
-    }
-
     idataVec.resize((r1 - r0) * (c1 - c0));  // max size, gets adjusted
     if (!blockread(&ptr, nRemainingBytes, idataVec))
         return false;
 
     size_t numValid = idataVec.size();
-    size_t i = 0;
+    const unsigned int *idata = idataVec.data();
     double q = maxZErrorInFile * 2;  // quanta
+    if (allValid && 1 == pixel_stride &&
+        numValid == static_cast<size_t>(r1 - r0) * (c1 - c0))
+    {  // One row at a time
+        for (int row = r0; row < r1; row++, idata += c1 - c0)
+        {
+            T *out = rowPtr(buffer, line_stride, row) + c0;
+            if (!dequantizeInt(idata, c1 - c0, minval, q, maxZInImg, out))
+                dequantize(idata, c1 - c0, minval, q, maxZInImg, out);
+        }
+        *ppByte = ptr;
+        return true;
+    }
+
+    size_t i = 0;
     for (int row = r0; row < r1; row++)
-        for (int col = c0; col < c1; col++)
-            if (IsValid(row, col))
+    {
+        T *out = rowPtr(buffer, line_stride, row) + c0 * pixel_stride;
+        int k = row * getWidth() + c0;
+        for (int col = c0; col < c1; col++, out += pixel_stride)
+        {
+            if (allValid || mask.IsValid(k))
             {
                 if (i >= numValid)
                     return false;
-                (*this)(row, col) = std::min(
-                    maxZInImg, static_cast<float>(minval + q * idataVec[i++]));
+                *out = static_cast<T>(std::min(
+                    maxZInImg, static_cast<float>(minval + q * idata[i++])));
             }
+            else
+                *out = ndv;
+            k++;
+        }
+    }
     if (i != numValid)
         return false;
 
@@ -973,4 +1910,23 @@ bool Lerc1Image::readZTile(Byte **ppByte, size_t &nRemainingBytes, int r0,
     return true;
 }
 
+// The decode output types
+#define INSTANTIATE(T)                                                         \
+    template bool Lerc1Image::read(Byte **, size_t &, double, T *, size_t, T,  \
+                                   int, int);                                  \
+    template bool Lerc1Image::write(Byte **, const T *, double, int, int)      \
+        const;                                                                 \
+    template unsigned int Lerc1Image::computeNumBytesNeededToWrite(            \
+        const T *, double, InfoFromComputeNumBytes &, int, int) const;         \
+    template bool Lerc1Image::write(Byte **, size_t &, const T *,              \
+                                    const InfoFromComputeNumBytes &, int, int) \
+        const;
+INSTANTIATE(Byte)
+INSTANTIATE(uint16_t)
+INSTANTIATE(int16_t)
+INSTANTIATE(uint32_t)
+INSTANTIATE(int32_t)
+INSTANTIATE(float)
+#undef INSTANTIATE
+
 NAMESPACE_LERC1_END
@@ -70,6 +70,21 @@ class BitMaskV1
         bits.resize(size());
     }
 
+    // Sets all the bits, the unused ones in the last byte stay 0
+    void SetAll(bool v)
+    {
+        std::memset(bits.data(), v ? 0xff : 0, bits.size());
+        int extra = (m_nCols * m_nRows) & 7;
+        if (v && extra)
+            bits.back() = static_cast<Byte>(0xff << (8 - extra));
+    }
+
+    // Eight pixels per byte, MSB first
+    Byte *data()
+    {
+        return bits.data();
+    }
+
     // max RLE compressed size is n + 4 + 2 * (n - 1) / 32767
     // Returns encoded size
     int RLEcompress(Byte *aRLE) const;
@@ -107,7 +122,7 @@ class Lerc1Image
     /// compressed lossless or not at all) read succeeds only if maxZError on
     /// file <= maxZError requested (!)
 
-    Lerc1Image() : width_(0), height_(0)
+    Lerc1Image() : width_(0), height_(0), allValid(false)
     {
     }
 
@@ -153,6 +168,11 @@ class Lerc1Image
         return values.data();
     }
 
+    float* data()
+    {
+        return values.data();
+    }
+
     static unsigned int computeNumBytesNeededToWriteVoidImage();
 
     // Only initialize the size from the header, if LERC1
@@ -162,6 +182,16 @@ class Lerc1Image
     {
         setsize(width, height);
         mask.resize(getWidth(), getHeight());
+        allValid = false;
+    }
+
+    // Only the size and the mask, for writing values from a caller buffer
+    void resizeMask(int width, int height)
+    {
+        width_ = width;
+        height_ = height;
+        mask.resize(getWidth(), getHeight());
+        allValid = false;
     }
 
     bool IsValid(int row, int col) const
@@ -172,63 +202,157 @@ class Lerc1Image
     void SetMask(int row, int col, bool v)
     {
         mask.Set(row * getWidth() + col, v);
+        allValid = allValid && v;
+    }
+
+    // Whole mask, 8 pixels per byte, MSB first, rows are not byte aligned
+    void SetMask(bool v)
+    {
+        mask.SetAll(v);
+        allValid = v;
+    }
+
+    Byte *maskData()
+    {
+        allValid = false;
+        return mask.data();
     }
 
     // Read and write LERC1 into a memory buffer, controlled by maxZError
-    bool write(Byte **ppByte, double maxZError = 0) const;
+    // The write uses up to threads threads, the output does not depend on it
+    bool write(Byte **ppByte, double maxZError = 0, int threads = 1) const;
 
-    bool read(Byte **ppByte, size_t &nRemainingBytes, double maxZError);
+    // Statistics of the valid values in a region
+    // zMin is NaN if any valid value is not finite, both are 0 if none is valid
+    struct ZStats
+    {
+        float zMin = 0, zMax = 0;
+        int numValidPixel = 0, numFinite = 0;
 
-private:
+        void add(const ZStats &other);
+    };
+
+    // The layout of the encoded image, from computeNumBytesNeededToWrite
     struct InfoFromComputeNumBytes
     {
-        double maxZError;
-        int numTilesVertCnt;
-        int numTilesHoriCnt;
-        int numBytesCnt;
-        float maxCntInImg;
-        int numTilesVertZ;
-        int numTilesHoriZ;
-        int numBytesZ;
-        float maxZInImg;
-
-        InfoFromComputeNumBytes()
-        {
-            std::memset(this, 0, sizeof(*this));
-        }
+        unsigned int numBytes = 0;  // The whole LERC1
+        double maxZError = 0;
+        int numTilesVertCnt = 0;
+        int numTilesHoriCnt = 0;
+        int numBytesCnt = 0;
+        float maxCntInImg = 0;
+        int numTilesVertZ = 0;
+        int numTilesHoriZ = 0;
+        int numBytesZ = 0;
+        float maxZInImg = 0;
+        std::vector<ZStats> zStats;  // For the Z tiles
     };
 
-    bool findTiling(double maxZError, int& numTilesVert, int& numTilesHori,
-        int& numBytesOpt, float& maxValInImg) const;
+    // Encode from a caller buffer of type T, rows are getWidth() pixels long
+    // Pixels are pixel_stride values apart, the band count for interleaved data
+    // The size and mask of this image are used, the float values are not
+    // T is one of Byte, (u)int16, (u)int32 or float
+    template <typename T>
+    bool write(Byte **ppByte, const T *data, double maxZError = 0,
+               int threads = 1, int pixel_stride = 1) const;
+
+    // Encoding in two steps, the exact size is known before writing anything
+    // Returns the size in bytes, 0 on error. Same arguments as write
+    template <typename T>
+    unsigned int computeNumBytesNeededToWrite(const T *data, double maxZError,
+                                              InfoFromComputeNumBytes &info,
+                                              int threads = 1,
+                                              int pixel_stride = 1) const;
+
+    // Writes the same data, using the info from computeNumBytesNeededToWrite
+    // Fails without writing if the size is larger than nRemainingBytes
+    template <typename T>
+    bool write(Byte **ppByte, size_t &nRemainingBytes, const T *data,
+               const InfoFromComputeNumBytes &info, int threads = 1,
+               int pixel_stride = 1) const;
 
-    bool writeTiles(double maxZError, int numTilesVert, int numTilesHori,
-        Byte* bArr, int& numBytes, float& maxValInImg) const;
-
-    bool readTiles(double maxZErrorInFile, int numTilesVert, int numTilesHori,
-        float maxValInImg, Byte* bArr, size_t nRemainingBytes);
-
-    bool computeZStats(int r0, int r1, int c0, int c1, float& zMin, float& zMax,
-        int& numValidPixel, int& numFinite) const;
+    bool read(Byte **ppByte, size_t &nRemainingBytes, double maxZError);
 
-    // returns true if all floating point values in the region have the same
-    // binary representation
-    bool isallsameval(int r0, int r1, int c0, int c1) const;
+    // Decode directly into a caller buffer of type T, rows are line_stride
+    // bytes apart. Invalid pixels are set to ndv, the float values are not used
+    // The buffer has to fit the size from getwh()
+    // T is one of Byte, (u)int16, (u)int32 or float
+    // Large images are decoded using up to threads threads
+    // Pixels are pixel_stride values apart, to decode one band of interleaved data
+    template <typename T>
+    bool read(Byte **ppByte, size_t &nRemainingBytes, double maxZError,
+              T *buffer, size_t line_stride, T ndv, int threads = 1,
+              int pixel_stride = 1);
 
-    bool writeZTile(Byte** ppByte, int& numBytes, int r0, int r1, int c0,
-        int c1, int numValidPixel, float zMin, float zMax,
-        double maxZError) const;
+private:
+    // The tiles of one tiling, in row major order
+    struct Tiling
+    {
+        int numTilesVert, numTilesHori;
+        std::vector<ZStats> stats;
+    };
 
+    // The encoding functions take the values as data, of type T, with pixels
+    // pixel_stride values apart
+    template <typename T>
+    bool findTiling(const T* data, int pixel_stride, double maxZError,
+        int& numTilesVert, int& numTilesHori, int& numBytesOpt,
+        float& maxValInImg, std::vector<ZStats>& stats, int threads) const;
+
+    // Fills in the tile stats of all tilings, in one pass over the image
+    template <typename T>
+    void tileStats(const T* data, int pixel_stride,
+        std::vector<Tiling>& tilings, int threads) const;
+
+    // Encoded size of a Z tile, zMin may be moved up if that saves space
+    // isConst is set for a constant non-finite tile
+    template <typename T>
+    int zTileBytes(const T* data, int pixel_stride, const ZStats& stats,
+        int r0, int r1, int c0, int c1, double maxZError, float& zMin,
+        bool& isConst) const;
+
+    // Pass bArr == nullptr to estimate the size but skip the write
+    template <typename T>
+    bool writeTiles(const T* data, int pixel_stride, double maxZError,
+        int numTilesVert, int numTilesHori, const std::vector<ZStats>& stats,
+        Byte* bArr, int& numBytes, float& maxValInImg, int threads = 1) const;
+
+    template <typename T>
+    bool readTiles(double maxZErrorInFile, int numTilesVert, int numTilesHori,
+        float maxValInImg, Byte* bArr, size_t nRemainingBytes,
+        T* buffer, size_t line_stride, int pixel_stride, T ndv, int threads);
+
+    // Encoded size of a Z tile, from the headers only, 0 if not valid
+    size_t zTileSize(const Byte* pByte, size_t nRemainingBytes, int r0, int r1,
+        int c0, int c1) const;
+
+    // Stats of the cells between rows r0 and r1, cut at the cols edges
+    template <typename T>
+    void bandStats(const T* data, int pixel_stride, int r0, int r1,
+        const std::vector<int>& cols, std::vector<ZStats>& band) const;
+
+    // returns true if all values in the region have the same binary
+    // representation
+    template <typename T>
+    bool isallsameval(const T* data, int pixel_stride, int r0, int r1, int c0,
+        int c1) const;
+
+    template <typename T>
+    bool writeZTile(const T* data, int pixel_stride, Byte** ppByte,
+        int& numBytes, int r0, int r1, int c0, int c1, int numValidPixel,
+        float zMin, float zMax, double maxZError,
+        std::vector<unsigned int>& qdata) const;
+
+    template <typename T>
     bool readZTile(Byte** ppByte, size_t& nRemainingBytes, int r0, int r1,
-        int c0, int c1, double maxZErrorInFile, float maxZInImg);
-
-    unsigned int
-        computeNumBytesNeededToWrite(double maxZError, bool onlyZPart,
-            InfoFromComputeNumBytes* info) const;
+        int c0, int c1, double maxZErrorInFile, float maxZInImg,
+        T* buffer, size_t line_stride, int pixel_stride, T ndv,
+        std::vector<unsigned int>& idataVec) const;
 
     int width_, height_;
     std::vector<float> values;
-    std::vector<unsigned int> idataVec;  // temporary buffer
     BitMaskV1 mask;
+    bool allValid;  // The mask has no invalid pixels
 };
 
 NAMESPACE_LERC1_END
@@ -1,12 +1,57 @@
 #include "icd_codecs.h"
 #include <iostream>
 #include <vector>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <png.h>
 
 using namespace ICD;
 using namespace std;
 
+// Memory source for plain libpng reads
+struct png_memsrc {
+    const uint8_t* p;
+    size_t left;
+};
+
+static void png_memread(png_structp pngp, png_bytep data, png_size_t len) {
+    auto src = static_cast<png_memsrc*>(png_get_io_ptr(pngp));
+    if (len > src->left)
+        png_error(pngp, "Read past the end of the PNG");
+    memcpy(data, src->p, len);
+    src->p += len;
+    src->left -= len;
+}
+
+// Decodes a 16 bit PNG with libpng only, bypassing the in-tree decoder
+static bool libpng_decode16(const storage_manager& src, vector<uint16_t>& out) {
+    png_structp pngp = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop infop = pngp ? png_create_info_struct(pngp) : nullptr;
+    if (!infop) {
+        png_destroy_read_struct(&pngp, nullptr, nullptr);
+        return false;
+    }
+    if (setjmp(png_jmpbuf(pngp))) {
+        png_destroy_read_struct(&pngp, &infop, nullptr);
+        return false;
+    }
+    png_memsrc ms = { static_cast<const uint8_t*>(src.buffer), src.size };
+    png_set_read_fn(pngp, &ms, png_memread);
+    png_read_png(pngp, infop, PNG_TRANSFORM_IDENTITY, nullptr);
+    png_bytepp rows = png_get_rows(pngp, infop);
+    size_t values = png_get_rowbytes(pngp, infop) / 2;
+    size_t height = png_get_image_height(pngp, infop);
+    out.resize(values * height);
+    for (size_t y = 0; y < height; y++)
+        for (size_t i = 0; i < values; i++)
+            out[y * values + i] = static_cast<uint16_t>((rows[y][2 * i] << 8) | rows[y][2 * i + 1]);
+    png_destroy_read_struct(&pngp, &infop, nullptr);
+    return true;
+}
+
 // write and read a PNG RGB image
-int testPNG() {
+static int testPNG8() {
     Raster r = {};
     // x, y, z, c, l
     r.size = { 100, 100, 0, 3, 0 };
@@ -80,6 +125,536 @@ int testPNG() {
     return 0;
 }
 
+// Parallel encode of a 16 bit RGBA image, large enough for multiple blocks
+static int testPNGParallel() {
+    Raster r = {};
+    r.size = { 300, 400, 0, 4, 0 };
+    r.dt = ICDT_UInt16;
+    png_params p(r);
+    p.threads = 4;
+    vector<uint16_t> vsrc(p.get_buffer_size() / 2);
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = static_cast<uint16_t>((i * 7) ^ (i >> 5));
+    storage_manager src(vsrc.data(), vsrc.size() * 2);
+    vector<uint8_t> vdst(src.size * 2);
+    storage_manager dst(vdst.data(), vdst.size());
+    auto message = png_encode(p, src, dst);
+    if (message != nullptr) {
+        std::cerr << "Error in parallel PNG encode " << message << std::endl;
+        return 1;
+    }
+    std::cout << "Parallel compressed size: " << dst.size << std::endl;
+
+    codec_params p2(r);
+    vector<uint16_t> vout(vsrc.size());
+    message = stride_decode(p2, dst, vout.data());
+    if (message != nullptr) {
+        std::cerr << "Error decoding parallel PNG " << message << std::endl;
+        return 1;
+    }
+    if (vout != vsrc) {
+        std::cerr << "Parallel PNG mismatch" << std::endl;
+        return 1;
+    }
+
+    // Also readable by libpng alone
+    if (!libpng_decode16(dst, vout) || vout != vsrc) {
+        std::cerr << "Parallel PNG is not readable by libpng" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Sparse RGBA tile, automatic filter and strategy should be smaller than the default
+static int testPNGAuto() {
+    Raster r = {};
+    r.size = { 256, 256, 0, 4, 0 };
+    r.dt = ICDT_Byte;
+    vector<uint8_t> vsrc(256 * 256 * 4);
+    uint32_t seed = 1;
+    for (size_t y = 160; y < 256; y++)
+        for (size_t x = 192; x < 256; x++)
+            for (size_t c = 0; c < 4; c++) {
+                seed = seed * 1103515245 + 12345;
+                vsrc[(y * 256 + x) * 4 + c] = static_cast<uint8_t>(60 + x / 4 + y / 3 + c * 10
+                    + (seed >> 16) % 3);
+            }
+    storage_manager src(vsrc.data(), vsrc.size());
+    vector<uint8_t> vdst(src.size * 2);
+
+    size_t sizes[2];
+    for (int i = 0; i < 2; i++) {
+        png_params p(r);
+        if (i) {
+            p.filter = PNGF_AUTO;
+            p.strategy = PNGS_AUTO;
+        }
+        storage_manager dst(vdst.data(), vdst.size());
+        auto message = png_encode(p, src, dst);
+        if (message != nullptr) {
+            std::cerr << "Error in PNG encode " << message << std::endl;
+            return 1;
+        }
+        sizes[i] = dst.size;
+        codec_params p2(r);
+        vector<uint8_t> vout(vsrc.size());
+        message = stride_decode(p2, dst, vout.data());
+        if (message != nullptr || vout != vsrc) {
+            std::cerr << "PNG round trip failed" << std::endl;
+            return 1;
+        }
+    }
+    std::cout << "Default and auto PNG sizes: " << sizes[0] << " " << sizes[1] << std::endl;
+    return sizes[1] < sizes[0] ? 0 : 1;
+}
+
+// RGBA tile with three colors, one transparent, encoded as a 2 bit palette
+static int testPNGPalette() {
+    Raster r = {};
+    r.size = { 64, 64, 0, 4, 0 };
+    r.dt = ICDT_Byte;
+    static const uint8_t colors[3][4] = { { 0, 0, 0, 0 }, { 200, 30, 30, 255 }, { 30, 30, 220, 128 } };
+    vector<uint8_t> vsrc(64 * 64 * 4);
+    for (size_t i = 0; i < 64 * 64; i++)
+        memcpy(&vsrc[i * 4], colors[(i / 64 + i % 64) / 43], 4);
+    storage_manager src(vsrc.data(), vsrc.size());
+    vector<uint8_t> vdst(src.size * 2);
+
+    size_t sizes[2];
+    for (int i = 0; i < 2; i++) {
+        png_params p(r);
+        p.palette = i;
+        storage_manager dst(vdst.data(), vdst.size());
+        auto message = png_encode(p, src, dst);
+        if (message != nullptr) {
+            std::cerr << "Error in PNG encode " << message << std::endl;
+            return 1;
+        }
+        sizes[i] = dst.size;
+    }
+    std::cout << "RGBA and palette PNG sizes: " << sizes[0] << " " << sizes[1] << std::endl;
+
+    storage_manager dst(vdst.data(), sizes[1]);
+    Raster in_raster = {};
+    image_peek(dst, in_raster);
+    if (in_raster.size != r.size || in_raster.dt != ICDT_Byte) {
+        std::cerr << "Palette PNG peek mismatch" << std::endl;
+        return 1;
+    }
+    codec_params p2(in_raster);
+    vector<uint8_t> vout(vsrc.size());
+    auto message = stride_decode(p2, dst, vout.data());
+    if (message != nullptr || vout != vsrc) {
+        std::cerr << "Palette PNG round trip failed" << std::endl;
+        return 1;
+    }
+    return sizes[1] < sizes[0] ? 0 : 1;
+}
+
+// Smooth RGB tile with 4096 colors, quantized to a palette
+static int testPNGQuantize() {
+    Raster r = {};
+    r.size = { 64, 64, 0, 3, 0 };
+    r.dt = ICDT_Byte;
+    vector<uint8_t> vsrc(64 * 64 * 3);
+    for (size_t i = 0; i < 64 * 64; i++) {
+        size_t x = i % 64, y = i / 64;
+        vsrc[i * 3] = static_cast<uint8_t>(x * 4);
+        vsrc[i * 3 + 1] = static_cast<uint8_t>(y * 4);
+        vsrc[i * 3 + 2] = static_cast<uint8_t>(255 - (x + y) * 2);
+    }
+    storage_manager src(vsrc.data(), vsrc.size());
+    vector<uint8_t> vdst(src.size * 2);
+
+    // quantize, expected color type, maximum number of colors and RMS error
+    // Below 2 it is not quantized, above 256 it is clamped
+    static const struct { int quantize, color_type; size_t colors; double rms; } cases[] = {
+        { 16, 3, 16, 20 }, { 1, 2, 4096, 0 }, { 1000, 3, 256, 6 } };
+    for (auto const& c : cases) {
+        png_params p(r);
+        p.palette = 1;
+        p.quantize = c.quantize;
+        storage_manager dst(vdst.data(), vdst.size());
+        auto message = png_encode(p, src, dst);
+        if (message != nullptr) {
+            std::cerr << "Error in PNG encode " << message << std::endl;
+            return 1;
+        }
+        if (vdst[25] != c.color_type) {
+            std::cerr << "Quantized PNG color type " << int(vdst[25]) << ", quantize "
+                << c.quantize << std::endl;
+            return 1;
+        }
+
+        codec_params p2(r);
+        vector<uint8_t> vout(vsrc.size());
+        message = stride_decode(p2, dst, vout.data());
+        if (message != nullptr) {
+            std::cerr << "Error decoding quantized PNG " << message << std::endl;
+            return 1;
+        }
+        vector<uint32_t> colors(64 * 64);
+        double sum = 0;
+        for (size_t i = 0; i < colors.size(); i++) {
+            colors[i] = (vout[i * 3] << 16) | (vout[i * 3 + 1] << 8) | vout[i * 3 + 2];
+            for (size_t j = i * 3; j < i * 3 + 3; j++)
+                sum += (vout[j] - vsrc[j]) * (vout[j] - vsrc[j]);
+        }
+        std::sort(colors.begin(), colors.end());
+        size_t ncolors = std::unique(colors.begin(), colors.end()) - colors.begin();
+        double rms = std::sqrt(sum / vsrc.size());
+        if (ncolors > c.colors || rms > c.rms) {
+            std::cerr << "Quantized PNG has " << ncolors << " colors, RMS error " << rms
+                << ", quantize " << c.quantize << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// RGB tile with an NDV, encoded as a palette with tRNS, decoded back as RGB
+static int testPNGPaletteNDV() {
+    Raster r = {};
+    r.size = { 64, 64, 0, 3, 0 };
+    r.dt = ICDT_Byte;
+    r.has_ndv = 1;
+    r.ndv = 0;
+    vector<uint8_t> vsrc(64 * 64 * 3);
+    for (size_t i = 0; i < 64 * 64; i++)
+        memset(&vsrc[i * 3], ((i / 64 + i % 64) / 20) * 60, 3);
+    storage_manager src(vsrc.data(), vsrc.size());
+    vector<uint8_t> vdst(src.size * 2);
+    png_params p(r);
+    p.palette = 1;
+    p.has_transparency = 1;
+    storage_manager dst(vdst.data(), vdst.size());
+    auto message = png_encode(p, src, dst);
+    if (message != nullptr) {
+        std::cerr << "Error in PNG encode " << message << std::endl;
+        return 1;
+    }
+
+    // The guard bytes after the tile should not change
+    codec_params p2(r);
+    vector<uint8_t> vout(vsrc.size() + 256, 0x55);
+    message = stride_decode(p2, dst, vout.data());
+    if (message != nullptr || !std::equal(vsrc.begin(), vsrc.end(), vout.begin())
+        || std::count(vout.begin() + vsrc.size(), vout.end(), 0x55) != 256) {
+        std::cerr << "Palette PNG with tRNS round trip failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Gray RGBA tile with binary alpha, written as gray with a tRNS key
+static int testPNGReduce() {
+    Raster r = {};
+    r.size = { 64, 64, 0, 4, 0 };
+    r.dt = ICDT_Byte;
+    vector<uint8_t> vsrc(64 * 64 * 4);
+    for (size_t i = 0; i < 64 * 64; i++) {
+        bool transparent = (i % 64) < 10;
+        uint8_t v = transparent ? 0 : static_cast<uint8_t>(1 + (i * 7) % 200);
+        memset(&vsrc[i * 4], v, 3);
+        vsrc[i * 4 + 3] = transparent ? 0 : 255;
+    }
+    storage_manager src(vsrc.data(), vsrc.size());
+    vector<uint8_t> vdst(src.size * 2);
+    png_params p(r);
+    p.reduce = true;
+    storage_manager dst(vdst.data(), vdst.size());
+    auto message = png_encode(p, src, dst);
+    if (message != nullptr) {
+        std::cerr << "Error in PNG encode " << message << std::endl;
+        return 1;
+    }
+    std::cout << "Reduced PNG size: " << dst.size << std::endl;
+
+    Raster in_raster = {};
+    image_peek(dst, in_raster);
+    if (in_raster.size.c != 1) {
+        std::cerr << "Expected a gray PNG, got " << in_raster.size.c << " bands" << std::endl;
+        return 1;
+    }
+    // Decode with the original band count
+    codec_params p2(r);
+    vector<uint8_t> vout(vsrc.size());
+    message = stride_decode(p2, dst, vout.data());
+    if (message != nullptr || vout != vsrc) {
+        std::cerr << "Reduced PNG round trip failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Interlaced PNG, decoded at every reduction
+static int testPNGInterlaced() {
+    Raster r = {};
+    r.size = { 100, 75, 0, 3, 0 };
+    r.dt = ICDT_Byte;
+    png_params p(r);
+    p.interlace = true;
+    vector<uint8_t> vsrc(p.get_buffer_size());
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = static_cast<uint8_t>(i * 31 + i / 7);
+    storage_manager src(vsrc.data(), vsrc.size());
+    vector<uint8_t> vdst(src.size * 2);
+    storage_manager dst(vdst.data(), vdst.size());
+    auto message = png_encode(p, src, dst);
+    if (message != nullptr) {
+        std::cerr << "Error in PNG encode " << message << std::endl;
+        return 1;
+    }
+
+    for (int reduction = 0; reduction <= 3; reduction++) {
+        codec_params p2(r);
+        p2.reduction = reduction;
+        p2.reset();
+        storage_manager in(dst.buffer, dst.size);
+        vector<uint8_t> vout(p2.get_buffer_size());
+        message = stride_decode(p2, in, vout.data());
+        if (message != nullptr) {
+            std::cerr << "Error decoding interlaced PNG " << message << std::endl;
+            return 1;
+        }
+        // Should be the pixels at multiples of 2^reduction
+        size_t width = p2.reduced(r.size.x);
+        for (size_t i = 0; i < vout.size(); i++) {
+            size_t x = i / 3 % width, y = i / 3 / width;
+            if (vout[i] != vsrc[(((y << reduction) * r.size.x) + (x << reduction)) * 3 + i % 3]) {
+                std::cerr << "Interlaced PNG mismatch at reduction " << reduction << std::endl;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Chunk index and CRC handling
+static int testPNGChunks() {
+    Raster r = {};
+    r.size = { 100, 75, 0, 3, 0 };
+    r.dt = ICDT_Byte;
+    png_params p(r);
+    vector<uint8_t> vsrc(p.get_buffer_size());
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = static_cast<uint8_t>(i * 31 + i / 7);
+    storage_manager src(vsrc.data(), vsrc.size());
+    vector<uint8_t> vdst(src.size * 2);
+    storage_manager dst(vdst.data(), vdst.size());
+    auto message = png_encode(p, src, dst);
+    if (message != nullptr) {
+        std::cerr << "Error in PNG encode " << message << std::endl;
+        return 1;
+    }
+
+    png_chunk index[16];
+    size_t count = 16;
+    message = png_chunks(dst, index, count, true);
+    if (message != nullptr || count < 3 || count > 16 || memcmp(index[0].type, "IHDR", 4)
+        || index[0].offset != 16 || index[0].length != 13
+        || memcmp(index[count - 1].type, "IEND", 4)) {
+        std::cerr << "Wrong PNG chunk index" << std::endl;
+        return 1;
+    }
+
+    // Break the CRC of the first IDAT
+    size_t i = 0;
+    while (memcmp(index[i].type, "IDAT", 4))
+        i++;
+    vdst[index[i].offset + index[i].length] ^= 1;
+    for (auto integrity : { INTEGRITY_DEFAULT, INTEGRITY_VERIFY, INTEGRITY_TRUSTED }) {
+        codec_params p2(r);
+        p2.integrity = integrity;
+        storage_manager in(dst.buffer, dst.size);
+        vector<uint8_t> vout(p2.get_buffer_size());
+        message = stride_decode(p2, in, vout.data());
+        // Only trusted decoding ignores the CRC
+        if ((message == nullptr) != (integrity == INTEGRITY_TRUSTED)
+            || (message == nullptr && vout != vsrc)) {
+            std::cerr << "PNG CRC error not handled for integrity " << integrity << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Decode into a larger canvas, partly outside of it
+static int testPNGCanvas() {
+    Raster r = {};
+    r.size = { 60, 40, 0, 3, 0 };
+    r.dt = ICDT_Byte;
+    vector<uint8_t> vsrc(60 * 40 * 3);
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = static_cast<uint8_t>(i * 31 + i / 7);
+    const size_t cx = 100, cy = 30, xo = 50, yskip = 10;
+
+    for (int interlace = 0; interlace < 2; interlace++) {
+        png_params p(r);
+        p.interlace = interlace;
+        storage_manager src(vsrc.data(), vsrc.size());
+        vector<uint8_t> vdst(src.size * 2);
+        storage_manager dst(vdst.data(), vdst.size());
+        auto message = png_encode(p, src, dst);
+        if (message != nullptr) {
+            std::cerr << "Error in PNG encode " << message << std::endl;
+            return 1;
+        }
+
+        codec_params p2(r);
+        p2.line_stride = cx * 3;
+        p2.x_offset = xo;
+        p2.y_offset = -static_cast<ptrdiff_t>(yskip);
+        p2.canvas_x = cx;
+        p2.canvas_y = cy;
+        vector<uint8_t> canvas(cx * cy * 3, 1);
+        message = stride_decode(p2, dst, canvas.data());
+        if (message != nullptr) {
+            std::cerr << "Error decoding PNG into canvas " << message << std::endl;
+            return 1;
+        }
+        // Tile rows 10 to 39 and columns 0 to 49 land in the canvas, the rest is untouched
+        for (size_t y = 0; y < cy; y++) {
+            for (size_t x = 0; x < cx * 3; x++) {
+                uint8_t expected = (x < xo * 3) ? 1 : vsrc[(y + yskip) * 60 * 3 + x - xo * 3];
+                if (canvas[y * cx * 3 + x] != expected) {
+                    std::cerr << "PNG canvas mismatch, interlace " << interlace << std::endl;
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// 16 bit single thread encode, read by libpng alone, checks the sample byte order
+static int testPNG16() {
+    Raster r = {};
+    r.size = { 70, 45, 0, 3, 0 };
+    r.dt = ICDT_UInt16;
+    vector<uint16_t> vsrc(70 * 45 * 3);
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = static_cast<uint16_t>(i * 331 + (i << 9));
+    storage_manager src(vsrc.data(), vsrc.size() * 2);
+    for (int interlace = 0; interlace < 2; interlace++) {
+        png_params p(r);
+        p.interlace = interlace;
+        vector<uint8_t> vdst(src.size * 2);
+        storage_manager dst(vdst.data(), vdst.size());
+        auto message = png_encode(p, src, dst);
+        if (message != nullptr) {
+            std::cerr << "Error in PNG encode " << message << std::endl;
+            return 1;
+        }
+        vector<uint16_t> vout;
+        if (!libpng_decode16(dst, vout) || vout != vsrc) {
+            std::cerr << "16 bit PNG mismatch, interlace " << interlace << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Single thread encode with each strategy, the deflate backend writes the stream in one IDAT
+static int testPNGBackend() {
+    std::cout << "PNG deflate backend: " << png_backend() << std::endl;
+    Raster r = {};
+    r.size = { 120, 90, 0, 2, 0 };
+    r.dt = ICDT_UInt16;
+    vector<uint16_t> vsrc(120 * 90 * 2);
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = static_cast<uint16_t>((i / 240) * 100 + (i % 240 < 120 ? 7 : i * 13));
+    storage_manager src(vsrc.data(), vsrc.size() * 2);
+    for (auto strategy : { PNGS_DEFAULT, PNGS_FILTERED, PNGS_RLE, PNGS_HUFFMAN, PNGS_AUTO }) {
+        png_params p(r);
+        p.strategy = strategy;
+        vector<uint8_t> vdst(src.size * 2);
+        storage_manager dst(vdst.data(), vdst.size());
+        auto message = png_encode(p, src, dst);
+        if (message != nullptr) {
+            std::cerr << "Error in PNG encode " << message << std::endl;
+            return 1;
+        }
+
+        png_chunk index[8];
+        size_t count = 8, idat = 0;
+        message = png_chunks(dst, index, count, true);
+        for (size_t i = 0; message == nullptr && i < count && i < 8; i++)
+            idat += !memcmp(index[i].type, "IDAT", 4);
+        if (message != nullptr || idat != 1) {
+            std::cerr << "PNG backend did not write a single IDAT, strategy " << strategy << std::endl;
+            return 1;
+        }
+
+        for (auto integrity : { INTEGRITY_DEFAULT, INTEGRITY_TRUSTED }) {
+            codec_params p2(r);
+            p2.integrity = integrity;
+            vector<uint16_t> vout(vsrc.size());
+            message = stride_decode(p2, dst, vout.data());
+            if (message != nullptr || vout != vsrc) {
+                std::cerr << "PNG backend round trip failed, strategy " << strategy << std::endl;
+                return 1;
+            }
+        }
+        vector<uint16_t> vout;
+        if (!libpng_decode16(dst, vout) || vout != vsrc) {
+            std::cerr << "PNG backend output is not readable by libpng" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// 16 bit elevation with a NDV, written as the tRNS color
+static int testPNGNDV() {
+    Raster r = {};
+    r.size = { 80, 50, 0, 1, 0 };
+    r.dt = ICDT_UInt16;
+    r.has_ndv = 1;
+    r.ndv = 40000;
+    vector<uint16_t> vsrc(80 * 50);
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = (i % 7) ? static_cast<uint16_t>(1000 + i % 80 + i / 80) : 40000;
+    png_params p(r);
+    p.has_transparency = true;
+    storage_manager src(vsrc.data(), vsrc.size() * 2);
+    vector<uint8_t> vdst(src.size * 2);
+    storage_manager dst(vdst.data(), vdst.size());
+    auto message = png_encode(p, src, dst);
+    if (message != nullptr) {
+        std::cerr << "Error in PNG encode " << message << std::endl;
+        return 1;
+    }
+    Raster peeked = {};
+    if (png_peek(dst, peeked) || !peeked.has_ndv || peeked.ndv != r.ndv) {
+        std::cerr << "PNG NDV not found" << std::endl;
+        return 1;
+    }
+
+    // Decoded with alpha, the NDV pixels are transparent
+    r.size.c = 2;
+    codec_params p2(r);
+    vector<uint16_t> vout(80 * 50 * 2);
+    message = stride_decode(p2, dst, vout.data());
+    if (message != nullptr) {
+        std::cerr << "Error decoding PNG " << message << std::endl;
+        return 1;
+    }
+    for (size_t i = 0; i < vsrc.size(); i++) {
+        if (vout[2 * i] != vsrc[i] || vout[2 * i + 1] != ((vsrc[i] == 40000) ? 0 : 0xffff)) {
+            std::cerr << "PNG NDV mismatch" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int testPNG() {
+    return testPNG8() | testPNGParallel() | testPNGAuto() | testPNGPalette() | testPNGPaletteNDV()
+        | testPNGQuantize() | testPNGReduce() | testPNGInterlaced() | testPNGChunks() | testPNGCanvas()
+        | testPNGNDV() | testPNG16() | testPNGBackend();
+}
+
 // Write and read an RGB JPEG image
 static int testJPEG8() {
     Raster r = {};
@@ -265,15 +840,232 @@ static int testJPEG12() {
         std::cerr << "Error too high" << std::endl;
         return 1;
     }
+
+    // Decode again from a caller supplied arena, sized by the peak usage
+    // It starts misaligned, the arena rounds the start up to 16 bytes
+    size_t peak = peak_memory_jpeg12();
+    std::cout << "JPEG12 decode peak memory: " << peak << std::endl;
+    vector<uint8_t> varena(peak + 17);
+    storage_manager arena(varena.data() + 1, peak + 16);
+    set_arena_jpeg12(&arena);
+    vector<uint16_t> vdst3(vdst2.size());
+    message = stride_decode(p2, dst, vdst3.data());
+    set_arena_jpeg12(nullptr);
+    if (message != nullptr || vdst3 != vdst2 || peak_memory_jpeg12() != peak) {
+        std::cerr << "Error decompressing JPEG from arena" << std::endl;
+        return 1;
+    }
     return 0;
 }
 
+// Requantize an 8 bit JPEG to a lower quality, check that the mask survives
+static int testJPEGRequant() {
+    Raster r = {};
+    // x, y, z, c, l
+    r.size = { 100, 100, 0, 3, 0 };
+    r.dt = ICDT_Byte;
+    jpeg_params p(r);
+    p.quality = 90;
+    vector<uint8_t> vsrc(p.get_buffer_size());
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = (i / 3) % 256;
+    // Make the first pixel black
+    vsrc[0] = vsrc[1] = vsrc[2] = 0;
+    storage_manager src(vsrc.data(), vsrc.size());
+
+    std::vector<uint8_t> vjpg(p.get_buffer_size() * 2);
+    storage_manager jpg(vjpg.data(), vjpg.size());
+    auto message = jpeg_encode(p, src, jpg);
+    if (message != nullptr) {
+        std::cerr << "Error compressing JPEG " << message << std::endl;
+        return 1;
+    }
+
+    p.quality = 50;
+    std::vector<uint8_t> vreq(jpg.size);
+    storage_manager req(vreq.data(), vreq.size());
+    message = jpeg_requantize(p, jpg, req);
+    if (message != nullptr) {
+        std::cerr << "Error requantizing JPEG " << message << std::endl;
+        return 1;
+    }
+    std::cout << "Requantized size: " << jpg.size << " -> " << req.size << std::endl;
+    if (req.size >= jpg.size) {
+        std::cerr << "Requantized JPEG is not smaller" << std::endl;
+        return 1;
+    }
+
+    codec_params p2(r);
+    vector<uint8_t> vdst(p2.get_buffer_size());
+    message = stride_decode(p2, req, vdst.data());
+    if (message != nullptr) {
+        std::cerr << "Error decompressing JPEG " << message << std::endl;
+        return 1;
+    }
+
+    // The zero mask should still apply
+    if (vdst[0] || vdst[1] || vdst[2] || !p2.modified) {
+        std::cerr << "Zen mask lost during requantization" << std::endl;
+        return 1;
+    }
+
+    float error = 0;
+    for (size_t i = 0; i < vsrc.size(); i++)
+        error += abs(vsrc[i] - vdst[i]);
+    error /= vsrc.size();
+    std::cout << "Requantized to " << p.quality << ": average error " << error << std::endl;
+    if (error > 8) {
+        std::cerr << "Error too high" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Encode an 8 bit JPEG to fit in a given number of bytes
+static int testJPEGBudget() {
+    Raster r = {};
+    // x, y, z, c, l
+    r.size = { 100, 100, 0, 3, 0 };
+    r.dt = ICDT_Byte;
+    jpeg_params p(r);
+    p.quality = 90;
+    p.budget = 2000;
+    vector<uint8_t> vsrc(p.get_buffer_size());
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = (i / 3) % 256;
+    storage_manager src(vsrc.data(), vsrc.size());
+
+    std::vector<uint8_t> vjpg(p.get_buffer_size() * 2);
+    storage_manager jpg(vjpg.data(), vjpg.size());
+    auto message = jpeg_encode(p, src, jpg);
+    if (message != nullptr) {
+        std::cerr << "Error compressing JPEG " << message << std::endl;
+        return 1;
+    }
+    std::cout << "Budget " << p.budget << ": quality " << p.quality
+        << " size " << jpg.size << std::endl;
+    if (jpg.size > p.budget || p.quality >= 90 || p.quality < 1) {
+        std::cerr << "JPEG budget not respected" << std::endl;
+        return 1;
+    }
+
+    codec_params p2(r);
+    vector<uint8_t> vdst(p2.get_buffer_size());
+    message = stride_decode(p2, jpg, vdst.data());
+    if (message != nullptr) {
+        std::cerr << "Error decompressing JPEG " << message << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Decode an 8 bit JPEG at 1/8 of the size, from the DC coefficients
+static int testJPEGReduced() {
+    Raster r = {};
+    // x, y, z, c, l
+    r.size = { 100, 100, 0, 3, 0 };
+    r.dt = ICDT_Byte;
+    jpeg_params p(r);
+    p.quality = 90;
+    vector<uint8_t> vsrc(p.get_buffer_size(), 100);
+    // Make the top left 16x16 corner black
+    for (size_t y = 0; y < 16; y++)
+        memset(&vsrc[y * r.size.x * r.size.c], 0, 16 * r.size.c);
+    storage_manager src(vsrc.data(), vsrc.size());
+
+    std::vector<uint8_t> vjpg(p.get_buffer_size() * 2);
+    storage_manager jpg(vjpg.data(), vjpg.size());
+    auto message = jpeg_encode(p, src, jpg);
+    if (message != nullptr) {
+        std::cerr << "Error compressing JPEG " << message << std::endl;
+        return 1;
+    }
+
+    codec_params p2(r);
+    p2.reduction = 3;
+    p2.reset();
+    vector<uint8_t> vdst(p2.get_buffer_size());
+    if (vdst.size() != 13 * 13 * 3) {
+        std::cerr << "Wrong reduced buffer size " << vdst.size() << std::endl;
+        return 1;
+    }
+    message = stride_decode(p2, jpg, vdst.data());
+    if (message != nullptr) {
+        std::cerr << "Error decompressing JPEG " << message << std::endl;
+        return 1;
+    }
+    // Two black pixels on the first two lines, the rest should be close to 100
+    for (size_t i = 0; i < vdst.size(); i++) {
+        size_t x = (i / 3) % 13, y = i / 39;
+        bool black = x < 2 && y < 2;
+        if (black ? vdst[i] != 0 : abs(vdst[i] - 100) > 2) {
+            std::cerr << "Reduced JPEG mismatch at " << i << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Every speed profile, encode and decode, should be close to the exact one
+template<typename T> static int testJPEGProfileType(ICDDataType dt, int maxval) {
+    Raster r = {};
+    r.size = { 128, 96, 0, 3, 0 };
+    r.dt = dt;
+    vector<T> vsrc(128 * 96 * 3);
+    for (size_t i = 0; i < vsrc.size(); i++) {
+        size_t x = (i / 3) % 128, y = i / 3 / 128, c = i % 3;
+        vsrc[i] = static_cast<T>(maxval * (0.2 + 0.3 * (x + c * y) / 400.0 + 0.1 * sin(x / 9.0 + y / 7.0)));
+    }
+    storage_manager src(vsrc.data(), vsrc.size() * sizeof(T));
+    static const SPEED_T profiles[] = { SPEED_EXACT, SPEED_BALANCED, SPEED_FAST };
+    double errors[3];
+    for (int i = 0; i < 3; i++) {
+        jpeg_params p(r);
+        p.quality = 90;
+        p.profile = profiles[i];
+        vector<uint8_t> vdst(src.size * 2);
+        storage_manager dst(vdst.data(), vdst.size());
+        auto message = jpeg_encode(p, src, dst);
+        if (message != nullptr) {
+            std::cerr << "Error compressing JPEG " << message << std::endl;
+            return 1;
+        }
+        codec_params p2(r);
+        p2.profile = profiles[i];
+        vector<T> vout(vsrc.size());
+        message = stride_decode(p2, dst, vout.data());
+        if (message != nullptr) {
+            std::cerr << "Error decompressing JPEG " << message << std::endl;
+            return 1;
+        }
+        double sum = 0;
+        for (size_t j = 0; j < vsrc.size(); j++)
+            sum += std::fabs(static_cast<double>(vsrc[j]) - vout[j]);
+        errors[i] = sum / vsrc.size();
+    }
+    std::cout << "JPEG " << maxval + 1 << " levels, profile errors: " << errors[0] << " "
+        << errors[1] << " " << errors[2] << std::endl;
+    // Within one 8 bit level of the exact profile
+    double tolerance = maxval / 255.0;
+    if (errors[1] > errors[0] + tolerance || errors[2] > errors[0] + tolerance) {
+        std::cerr << "JPEG speed profile error too high" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static int testJPEGProfiles() {
+    return testJPEGProfileType<uint8_t>(ICDT_Byte, 255)
+        | testJPEGProfileType<uint16_t>(ICDT_UInt16, 4095);
+}
+
 int testJPEG() {
-    return testJPEG8() | testJPEG12();
+    return testJPEG8() | testJPEG12() | testJPEGRequant() | testJPEGBudget()
+        | testJPEGReduced() | testJPEGProfiles();
 }
 
 // Write and read a byte LERC raster
-int testLERC() {
+static int testLERC8() {
     Raster r = {};
     // x, y, z, c, l
     r.size = { 100, 100, 0, 1, 0 };
@@ -357,6 +1149,476 @@ int testLERC() {
     return 0;
 }
 
+// Float with NDV, decoded as int16 into a padded buffer, invalid pixels get the decode NDV
+static int testLERCTyped() {
+    Raster r = {};
+    r.size = { 70, 40, 0, 1, 0 };
+    r.dt = ICDT_Float;
+    r.has_ndv = 1;
+    r.ndv = -1000;
+    vector<float> vsrc(70 * 40);
+    for (size_t i = 0; i < vsrc.size(); i++) {
+        size_t x = i % 70, y = i / 70;
+        // Some invalid pixels, a zero area and a ramp
+        vsrc[i] = (i % 11 == 3) ? -1000.0f : (y < 16 && x < 16) ? 0.0f
+            : static_cast<float>(3 * x) - static_cast<float>(y);
+    }
+    lerc_params p(r);
+    storage_manager src(vsrc.data(), vsrc.size() * sizeof(float));
+    vector<uint8_t> vdst(src.size * 2);
+    storage_manager dst(vdst.data(), vdst.size());
+    auto message = lerc_encode(p, src, dst);
+    if (message != nullptr) {
+        std::cerr << "Error in LERC encode " << message << std::endl;
+        return 1;
+    }
+
+    r.dt = ICDT_Int16;
+    r.ndv = -5;
+    codec_params p2(r);
+    p2.line_stride = 80 * sizeof(int16_t);
+    vector<int16_t> vout(80 * 40, 0x5555);
+    message = stride_decode(p2, dst, vout.data());
+    if (message != nullptr) {
+        std::cerr << "Error decoding LERC " << message << std::endl;
+        return 1;
+    }
+    for (size_t y = 0; y < 40; y++) {
+        for (size_t x = 0; x < 80; x++) {
+            int16_t expected = (x >= 70) ? 0x5555
+                : (vsrc[y * 70 + x] == -1000.0f) ? -5 : static_cast<int16_t>(vsrc[y * 70 + x]);
+            if (vout[y * 80 + x] != expected) {
+                std::cerr << "LERC typed decode mismatch at " << x << "," << y << std::endl;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Only exact NDV matches are masked, and only when the NDV is set
+static int testLERCMask() {
+    Raster r = {};
+    r.size = { 37, 29, 0, 1, 0 };
+    r.dt = ICDT_Float;
+    vector<float> vsrc(37 * 29);
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = static_cast<float>(i % 5) * 0.25f;
+    for (int has_ndv = 0; has_ndv < 2; has_ndv++) {
+        r.has_ndv = has_ndv;
+        lerc_params p(r);
+        storage_manager src(vsrc.data(), vsrc.size() * sizeof(float));
+        vector<uint8_t> vdst(src.size * 2);
+        storage_manager dst(vdst.data(), vdst.size());
+        auto message = lerc_encode(p, src, dst);
+        if (message != nullptr) {
+            std::cerr << "Error in LERC encode " << message << std::endl;
+            return 1;
+        }
+        Raster rd = r;
+        rd.ndv = -1;
+        codec_params p2(rd);
+        vector<float> vout(vsrc.size());
+        message = stride_decode(p2, dst, vout.data());
+        if (message != nullptr) {
+            std::cerr << "Error decoding LERC " << message << std::endl;
+            return 1;
+        }
+        for (size_t i = 0; i < vsrc.size(); i++) {
+            if (vout[i] != ((has_ndv && vsrc[i] == 0) ? -1.0f : vsrc[i])) {
+                std::cerr << "LERC mask mismatch at " << i << std::endl;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Decoded as an integer type, an NDV outside of the type range is clamped, NaN is 0
+static int testLERCNDVClamp() {
+    Raster r = {};
+    r.size = { 37, 29, 0, 1, 0 };
+    r.dt = ICDT_Float;
+    r.has_ndv = 1;
+    r.ndv = 0;
+    vector<float> vsrc(37 * 29);
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = static_cast<float>(i % 5);
+    lerc_params p(r);
+    storage_manager src(vsrc.data(), vsrc.size() * sizeof(float));
+    vector<uint8_t> vdst(src.size * 2);
+    storage_manager dst(vdst.data(), vdst.size());
+    auto message = lerc_encode(p, src, dst);
+    if (message != nullptr) {
+        std::cerr << "Error in LERC encode " << message << std::endl;
+        return 1;
+    }
+    static const double ndvs[] = { NAN, 1e9, -5 };
+    static const uint16_t expected[] = { 0, 65535, 0 };
+    for (int t = 0; t < 3; t++) {
+        Raster rd = r;
+        rd.dt = ICDT_UInt16;
+        rd.ndv = ndvs[t];
+        codec_params p2(rd);
+        vector<uint16_t> vout(vsrc.size());
+        message = stride_decode(p2, dst, vout.data());
+        if (message != nullptr) {
+            std::cerr << "Error decoding LERC " << message << std::endl;
+            return 1;
+        }
+        for (size_t i = 0; i < vsrc.size(); i++) {
+            if (vout[i] != ((vsrc[i] == 0) ? expected[t] : static_cast<uint16_t>(vsrc[i]))) {
+                std::cerr << "LERC NDV clamp mismatch at " << i << std::endl;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Multithreaded encode and decode have the same output as a single thread
+static int testLERCThreads() {
+    Raster r = {};
+    r.size = { 600, 500, 0, 1, 0 };
+    r.dt = ICDT_Float;
+    r.res = 0.1;
+    r.has_ndv = 1;
+    r.ndv = -1;
+    vector<float> vsrc(600 * 500);
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = (i % 97 == 5) ? -1.0f : static_cast<float>((i % 600) * (i / 600) % 1000) / 3;
+    storage_manager src(vsrc.data(), vsrc.size() * sizeof(float));
+    vector<uint8_t> single;
+    vector<float> decoded;
+    for (int threads = 1; threads < 5; threads++) {
+        lerc_params p(r);
+        p.threads = threads;
+        vector<uint8_t> vdst(src.size * 2);
+        storage_manager dst(vdst.data(), vdst.size());
+        auto message = lerc_encode(p, src, dst);
+        if (message != nullptr) {
+            std::cerr << "Error in LERC encode " << message << std::endl;
+            return 1;
+        }
+        vdst.resize(dst.size);
+        if (threads == 1)
+            single = vdst;
+        else if (vdst != single) {
+            std::cerr << "LERC encode with " << threads << " threads is different" << std::endl;
+            return 1;
+        }
+
+        codec_params p2(r);
+        p2.threads = threads;
+        vector<float> vout(vsrc.size());
+        message = stride_decode(p2, dst, vout.data());
+        if (message != nullptr) {
+            std::cerr << "Error decoding LERC " << message << std::endl;
+            return 1;
+        }
+        if (threads == 1)
+            decoded = vout;
+        else if (vout != decoded) {
+            std::cerr << "LERC decode with " << threads << " threads is different" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// One bit width of the packed values, with and without a mask
+template<typename T> static int testLERCBitsType(ICDDataType dt, int nbits) {
+    Raster r = {};
+    r.size = { 67, 45, 0, 1, 0 };
+    r.dt = dt;
+    r.res = 0.5;
+    r.ndv = -1;
+    vector<T> vsrc(67 * 45);
+    // Values wider than 24 bits keep only the top 24, so they are exact as float
+    uint32_t mask = ((1u << nbits) - 1) & ~((1u << std::max(0, nbits - 24)) - 1);
+    for (int has_ndv = 0; has_ndv < 2; has_ndv++) {
+        uint32_t seed = nbits;
+        for (size_t i = 0; i < vsrc.size(); i++) {
+            seed = seed * 1103515245 + 12345;
+            vsrc[i] = (has_ndv && i % 13 == 7) ? static_cast<T>(-1)
+                : static_cast<T>((seed >> 4) & mask);
+        }
+        r.has_ndv = has_ndv;
+        lerc_params p(r);
+        storage_manager src(vsrc.data(), vsrc.size() * sizeof(T));
+        vector<uint8_t> vdst(src.size * 2);
+        storage_manager dst(vdst.data(), vdst.size());
+        auto message = lerc_encode(p, src, dst);
+        if (message != nullptr) {
+            std::cerr << "Error in LERC encode " << message << std::endl;
+            return 1;
+        }
+        codec_params p2(r);
+        vector<T> vout(vsrc.size());
+        message = stride_decode(p2, dst, vout.data());
+        if (message != nullptr) {
+            std::cerr << "Error decoding LERC " << message << std::endl;
+            return 1;
+        }
+        // Integer values with a precision of 1 are exact
+        for (size_t i = 0; i < vsrc.size(); i++) {
+            if (vout[i] != vsrc[i]) {
+                std::cerr << "LERC " << nbits << " bit values mismatch at " << i << std::endl;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Single tile LERC1 blob of 8x4 32 bit integers, bit stuffed with nbits per value
+static vector<uint8_t> lerc1_stuffed(const vector<uint32_t>& v, int nbits) {
+    vector<uint8_t> blob;
+    auto put = [&](const void* p, size_t len) {
+        blob.insert(blob.end(), static_cast<const uint8_t*>(p), static_cast<const uint8_t*>(p) + len);
+    };
+    // Version, type, height, width, maxZError
+    int header[4] = { 11, 8, 4, 8 };
+    double maxZError = 0.5;
+    put("CntZImage ", 10);
+    put(header, sizeof(header));
+    put(&maxZError, sizeof(maxZError));
+    // All valid mask, then one Z tile
+    int part[3] = { 0, 0, 0 };
+    float maxval = 1;
+    put(part, sizeof(part));
+    put(&maxval, sizeof(maxval));
+    part[0] = part[1] = 1;
+    part[2] = 4 + nbits * 4;
+    maxval = static_cast<float>(*std::max_element(v.begin(), v.end()));
+    put(part, sizeof(part));
+    put(&maxval, sizeof(maxval));
+    // Bit stuffed with a one byte zero minimum, one byte count of 32
+    uint8_t tile[4] = { 0x81, 0, static_cast<uint8_t>(0x80 | nbits), 32 };
+    put(tile, sizeof(tile));
+    // Values from the high end of native 32 bit words
+    uint64_t acc = 0;
+    int bits = 0;
+    for (auto val : v) {
+        acc = (acc << nbits) | val;
+        bits += nbits;
+        if (bits >= 32) {
+            bits -= 32;
+            uint32_t word = static_cast<uint32_t>(acc >> bits);
+            put(&word, 4);
+        }
+    }
+    return blob;
+}
+
+// Every bit width of the packed values, up to 28
+// Floats are exact only below 2^24, wider values use 32 bit integers
+// lerc_encode never packs more than 25 bits, the wider values are read from hand built tiles
+static int testLERCBits() {
+    for (int nbits = 1; nbits <= 28; nbits++) {
+        if (nbits <= 24 ? testLERCBitsType<float>(ICDT_Float, nbits)
+            : testLERCBitsType<int32_t>(ICDT_Int32, nbits))
+            return 1;
+    }
+
+    Raster r = {};
+    r.size = { 8, 4, 0, 1, 0 };
+    r.dt = ICDT_Int32;
+    for (int nbits = 25; nbits <= 28; nbits++) {
+        vector<uint32_t> vsrc(32);
+        uint32_t seed = nbits;
+        for (auto& val : vsrc) {
+            seed = seed * 1103515245 + 12345;
+            val = (((seed >> 8) | 0x800000) & 0xffffff) << (nbits - 24);
+        }
+        vector<uint8_t> blob = lerc1_stuffed(vsrc, nbits);
+        storage_manager src(blob.data(), blob.size());
+        codec_params p(r);
+        vector<int32_t> vout(32);
+        auto message = stride_decode(p, src, vout.data());
+        if (message != nullptr || !std::equal(vsrc.begin(), vsrc.end(), vout.begin(),
+            [](uint32_t a, int32_t b) { return a == static_cast<uint32_t>(b); })) {
+            std::cerr << "LERC " << nbits << " bit stuffed tile mismatch" << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Lossless round trip of full range 16 bit integers
+template<typename T> static int testLERCIntType(ICDDataType dt) {
+    Raster r = {};
+    r.size = { 53, 41, 0, 1, 0 };
+    r.dt = dt;
+    r.has_ndv = 1;
+    r.ndv = 1;
+    vector<T> vsrc(53 * 41);
+    uint32_t seed = 3;
+    for (size_t i = 0; i < vsrc.size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        vsrc[i] = (i % 17 == 2) ? static_cast<T>(1) : static_cast<T>(seed >> 16);
+    }
+    lerc_params p(r);
+    storage_manager src(vsrc.data(), vsrc.size() * sizeof(T));
+    vector<uint8_t> vdst(src.size * 2 + 1024);
+    storage_manager dst(vdst.data(), vdst.size());
+    auto message = lerc_encode(p, src, dst);
+    if (message != nullptr) {
+        std::cerr << "Error in LERC encode " << message << std::endl;
+        return 1;
+    }
+    codec_params p2(r);
+    vector<T> vout(vsrc.size());
+    message = stride_decode(p2, dst, vout.data());
+    if (message != nullptr) {
+        std::cerr << "Error decoding LERC " << message << std::endl;
+        return 1;
+    }
+    if (vout != vsrc) {
+        std::cerr << "LERC integer type " << dt << " round trip mismatch" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+static int testLERCInt() {
+    return testLERCIntType<uint16_t>(ICDT_UInt16) | testLERCIntType<int16_t>(ICDT_Int16);
+}
+
+// Three interleaved bands, with NDV, serial and threaded
+static int testLERCBands() {
+    Raster r = {};
+    r.size = { 61, 37, 0, 3, 0 };
+    r.dt = ICDT_Float32;
+    r.has_ndv = 1;
+    r.ndv = -1;
+    vector<float> vsrc(61 * 37 * 3);
+    for (size_t i = 0; i < vsrc.size(); i++) {
+        size_t b = i % 3, px = i / 3;
+        vsrc[i] = (b == 1 && px % 11 == 4) ? -1.0f : static_cast<float>((px * (b + 1)) % 251);
+    }
+    storage_manager src(vsrc.data(), vsrc.size() * sizeof(float));
+    vector<uint8_t> vdst[2];
+    for (int t = 0; t < 2; t++) {
+        lerc_params p(r);
+        p.threads = t ? 4 : 1;
+        vdst[t].resize(src.size * 2 + 1024);
+        storage_manager dst(vdst[t].data(), vdst[t].size());
+        auto message = lerc_encode(p, src, dst);
+        if (message != nullptr) {
+            std::cerr << "Error in LERC bands encode " << message << std::endl;
+            return 1;
+        }
+        vdst[t].resize(dst.size);
+
+        Raster pr = {};
+        message = lerc_peek(dst, pr);
+        if (message != nullptr || pr.size.c != 3 || pr.size.x != 61 || pr.size.y != 37) {
+            std::cerr << "LERC bands peek failed" << std::endl;
+            return 1;
+        }
+
+        codec_params p2(r);
+        p2.threads = p.threads;
+        vector<float> vout(vsrc.size());
+        message = stride_decode(p2, dst, vout.data());
+        if (message != nullptr) {
+            std::cerr << "Error decoding LERC bands " << message << std::endl;
+            return 1;
+        }
+        if (vout != vsrc) {
+            std::cerr << "LERC bands round trip mismatch" << std::endl;
+            return 1;
+        }
+    }
+    if (vdst[0] != vdst[1]) {
+        std::cerr << "LERC threaded bands encode differs" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// LERC has no reduced size decode, it should fail instead of writing past the buffer
+static int testLERCReduction() {
+    Raster r = {};
+    r.size = { 64, 64, 0, 1, 0 };
+    r.dt = ICDT_Float32;
+    vector<float> vsrc(64 * 64);
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = static_cast<float>(i % 97);
+    lerc_params p(r);
+    storage_manager src(vsrc.data(), vsrc.size() * sizeof(float));
+    vector<uint8_t> vdst(src.size * 2 + 1024);
+    storage_manager dst(vdst.data(), vdst.size());
+    auto message = lerc_encode(p, src, dst);
+    if (message != nullptr) {
+        std::cerr << "Error in LERC encode " << message << std::endl;
+        return 1;
+    }
+
+    codec_params p2(r);
+    p2.reduction = 1;
+    p2.reset();
+    vector<float> vout(p2.get_buffer_size() / sizeof(float));
+    if (stride_decode(p2, dst, vout.data()) == nullptr
+        || lerc_stride_decode(p2, dst, vout.data()) == nullptr) {
+        std::cerr << "LERC decode with a reduction should fail" << std::endl;
+        return 1;
+    }
+
+    // An invalid reduction has no buffer size
+    p2.reduction = -1;
+    p2.reset();
+    if (p2.get_buffer_size() != 0 || p2.line_stride != 0
+        || stride_decode(p2, dst, vout.data()) == nullptr) {
+        std::cerr << "Invalid reduction not rejected" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Size query, exact size encode and a buffer one byte short, which is not written
+static int testLERCSize() {
+    Raster r = {};
+    r.size = { 45, 38, 0, 2, 0 };
+    r.dt = ICDT_UInt16;
+    r.res = 3;
+    vector<uint16_t> vsrc(45 * 38 * 2);
+    for (size_t i = 0; i < vsrc.size(); i++)
+        vsrc[i] = static_cast<uint16_t>((i * 7919) % 1201);
+    lerc_params p(r);
+    storage_manager src(vsrc.data(), vsrc.size() * sizeof(uint16_t));
+    storage_manager query;
+    auto message = lerc_encode(p, src, query);
+    if (message != nullptr || query.size == 0) {
+        std::cerr << "LERC size query failed" << std::endl;
+        return 1;
+    }
+
+    vector<uint8_t> vdst(query.size, 0xaa);
+    storage_manager shortdst(vdst.data(), query.size - 1);
+    message = lerc_encode(p, src, shortdst);
+    if (message == nullptr || shortdst.size != query.size
+        || std::count(vdst.begin(), vdst.end(), 0xaa) != static_cast<ptrdiff_t>(vdst.size())) {
+        std::cerr << "LERC encode into a short buffer did not fail cleanly" << std::endl;
+        return 1;
+    }
+
+    storage_manager dst(vdst.data(), vdst.size());
+    message = lerc_encode(p, src, dst);
+    if (message != nullptr || dst.size != query.size) {
+        std::cerr << "LERC exact size encode failed" << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int testLERC() {
+    return testLERC8() | testLERCTyped() | testLERCMask() | testLERCThreads()
+        | testLERCBits() | testLERCInt() | testLERCBands() | testLERCSize()
+        | testLERCReduction() | testLERCNDVClamp();
+}
+
 #if defined(LIBQB3_FOUND)
 
 // Write and read a QB3 raster